@@ -0,0 +1,437 @@
+/*
+ * \file arith.c
+ *
+ * Arithmetic expansion. The text of a $((...)) is parsed into a flat array
+ * of nodes, children before their parents, which is walked on intmax_t.
+ * Variables are read and assigned by name as the walk reaches them.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "arith.h"
+#include "cmd.h"
+#include "error.h"
+#include "str.h"
+#include "var.h"
+
+enum {
+  ANUM,     /* num */
+  AVAR,     /* num: offset of the name */
+  ANEG,     /* a */
+  ANOT,     /* a */
+  ACOMPL,   /* a */
+  APREINC,  /* a: the variable */
+  APREDEC,  /* a */
+  APOSTINC, /* a */
+  APOSTDEC, /* a */
+  AMUL,     /* a b, and so on for the binary operators */
+  ADIV,
+  AMOD,
+  AADD,
+  ASUB,
+  ASHL,
+  ASHR,
+  ALT,
+  ALE,
+  AGT,
+  AGE,
+  AEQ,
+  ANE,
+  ABAND,
+  ABXOR,
+  ABOR,
+  AAND,
+  AOR,
+  ACOND,   /* a b c */
+  AASSIGN, /* a b, c is the operator of an op= or AASSIGN */
+  ACOMMA,
+  AMAX
+};
+
+/* operands of each node */
+static const unsigned char arity[AMAX] = {
+    [ANUM] = 0,    [AVAR] = 0,     [ANEG] = 1,     [ANOT] = 1,
+    [ACOMPL] = 1,  [APREINC] = 1,  [APREDEC] = 1,  [APOSTINC] = 1,
+    [APOSTDEC] = 1, [AMUL ... AOR] = 2, [ACOND] = 3, [AASSIGN] = 2,
+    [ACOMMA] = 2,
+};
+
+/* precedences, the lowest binds loosest */
+#define PCOMMA  1
+#define PASSIGN 2
+#define PCOND   3
+
+static const struct {
+  char s[4];
+  int op;
+  int prec;
+} binops[] = {
+    /* longest first, so a prefix never wins */
+    {"<<=", ASHL, PASSIGN}, {">>=", ASHR, PASSIGN}, {"*=", AMUL, PASSIGN},
+    {"/=", ADIV, PASSIGN},  {"%=", AMOD, PASSIGN},  {"+=", AADD, PASSIGN},
+    {"-=", ASUB, PASSIGN},  {"&=", ABAND, PASSIGN}, {"^=", ABXOR, PASSIGN},
+    {"|=", ABOR, PASSIGN},  {"||", AOR, 4},         {"&&", AAND, 5},
+    {"==", AEQ, 9},         {"!=", ANE, 9},         {"<=", ALE, 10},
+    {">=", AGE, 10},        {"<<", ASHL, 11},       {">>", ASHR, 11},
+    {"|", ABOR, 6},         {"^", ABXOR, 7},        {"&", ABAND, 8},
+    {"<", ALT, 10},         {">", AGT, 10},         {"+", AADD, 12},
+    {"-", ASUB, 12},        {"*", AMUL, 13},        {"/", ADIV, 13},
+    {"%", AMOD, 13},        {"=", AASSIGN, PASSIGN}, {"?", ACOND, PCOND},
+    {",", ACOMMA, PCOMMA},
+};
+
+#define LEN(a) (sizeof(a) / sizeof(*a))
+
+#define NAMES(ca) ((const char *)((ca)->node + (ca)->nnodes))
+
+/*
+ * parsing
+ *
+ * The text is parsed twice, once to count the nodes and the bytes of the
+ * names and once to fill them in.
+ */
+
+static const char *ap;    /* next character */
+static const char *aerr;  /* the first error */
+static struct carith *ca; /* being filled, NULL while counting */
+static int nnodes, namelen;
+static int lastvar; /* the variable that was the last operand */
+
+static int binary(int);
+
+static void error(const char *msg) {
+  if (!aerr)
+    aerr = msg;
+  /* nothing more is read */
+  ap = "";
+}
+
+static int node(int op, int a, int b, int c, intmax_t num) {
+  struct anode *np;
+
+  if (ca) {
+    np      = &ca->node[nnodes];
+    np->op  = op;
+    np->a   = a;
+    np->b   = b;
+    np->c   = c;
+    np->num = num;
+  }
+  return nnodes++;
+}
+
+static inline void skipblanks(void) {
+  while (*ap == ' ' || *ap == '\t' || *ap == '\n')
+    ap++;
+}
+
+static int var(void) {
+  const char *end = endofname(ap);
+  int len         = end - ap;
+
+  if (ca) {
+    memcpy((char *)NAMES(ca) + namelen, ap, len);
+    ((char *)NAMES(ca))[namelen + len] = '\0';
+  }
+  ap       = end;
+  namelen += len + 1;
+  return lastvar = node(AVAR, 0, 0, 0, namelen - len - 1);
+}
+
+static int unary(void) {
+  char *end;
+  intmax_t n;
+  int a, op;
+
+  skipblanks();
+  switch (*ap) {
+  case '+':
+  case '-':
+    /* ++ and -- before anything but a variable are two signs */
+    for (end = (char *)ap + 2; *end == ' ' || *end == '\t'; end++)
+      ;
+    if (ap[1] == *ap && is_name(*end)) {
+      op = *ap == '+' ? APREINC : APREDEC;
+      ap = end;
+      return node(op, var(), 0, 0, 0);
+    }
+    op = *ap++;
+    a  = unary();
+    return op == '-' ? node(ANEG, a, 0, 0, 0) : a;
+  case '!':
+    ap++;
+    return node(ANOT, unary(), 0, 0, 0);
+  case '~':
+    ap++;
+    return node(ACOMPL, unary(), 0, 0, 0);
+  case '(':
+    ap++;
+    a = binary(PCOMMA);
+    skipblanks();
+    if (*ap != ')')
+      error("missing )");
+    else
+      ap++;
+    return a;
+  }
+
+  if (is_digit(*ap)) {
+    errno = 0;
+    n     = strtoimax(ap, &end, 0);
+    if (errno == ERANGE || is_in_name(*end))
+      error("bad number");
+    else
+      ap = end;
+    return node(ANUM, 0, 0, 0, n);
+  }
+  if (!is_name(*ap)) {
+    error(*ap ? "syntax error" : "missing operand");
+    return 0;
+  }
+
+  a = var();
+  skipblanks();
+  if ((*ap == '+' || *ap == '-') && ap[1] == *ap) {
+    op  = *ap == '+' ? APOSTINC : APOSTDEC;
+    ap += 2;
+    return node(op, a, 0, 0, 0);
+  }
+  return a;
+}
+
+/* an expression of operators binding at least as tight as prec */
+static int binary(int prec) {
+  int a, b, c, i, op;
+
+  a = unary();
+  for (;;) {
+    skipblanks();
+    for (i = 0; i < (int)LEN(binops); i++)
+      if (!strncmp(ap, binops[i].s, strlen(binops[i].s)))
+        break;
+    if (i == LEN(binops) || binops[i].prec < prec)
+      return a;
+    ap += strlen(binops[i].s);
+    op  = binops[i].op;
+
+    switch (binops[i].prec) {
+    case PCOND:
+      b = binary(PCOMMA);
+      skipblanks();
+      if (*ap != ':')
+        error("missing :");
+      else
+        ap++;
+      c = binary(PCOND);
+      a = node(ACOND, a, b, c, 0);
+      break;
+    case PASSIGN:
+      if (a != lastvar)
+        error("assignment to a non-variable");
+      b = binary(PASSIGN);
+      a = node(AASSIGN, a, b, op, 0);
+      break;
+    default:
+      b = binary(binops[i].prec + 1);
+      a = node(op, a, b, 0, 0);
+      break;
+    }
+  }
+}
+
+static void parse(const char *s) {
+  ap      = s;
+  aerr    = NULL;
+  nnodes  = 0;
+  namelen = 0;
+  lastvar = -1;
+
+  skipblanks();
+  if (!*ap) {
+    /* $(( )) is 0 */
+    node(ANUM, 0, 0, 0, 0);
+    return;
+  }
+  binary(PCOMMA);
+  skipblanks();
+  if (*ap)
+    error("syntax error");
+}
+
+/*
+ * Parses the expression s into a node on the stack. Returns NULL with a
+ * message in *err if it is not valid.
+ */
+struct carith *arithparse(const char *s, const char **err) {
+  struct carith *c;
+
+  ca = NULL;
+  parse(s);
+  if (aerr) {
+    *err = aerr;
+    return NULL;
+  }
+
+  ca = (struct carith *)arithcmd(nnodes, namelen);
+  parse(s);
+  c  = ca;
+  ca = NULL;
+  return c;
+}
+
+/* Whether a node read back from a compiled script is sound. */
+int arithcheck(const struct carith *c) {
+  const struct anode *np;
+  size_t names;
+  int i;
+
+  if (c->nnodes <= 0 || (size_t)c->size < sizeof(*c) ||
+      (size_t)c->nnodes > (c->size - sizeof(*c)) / sizeof(*c->node))
+    return -1;
+  names = c->size - sizeof(*c) - c->nnodes * sizeof(*c->node);
+  if (names && NAMES(c)[names - 1] != '\0')
+    return -1;
+
+  for (i = 0, np = c->node; i < c->nnodes; i++, np++) {
+    if (np->op < 0 || np->op >= AMAX)
+      return -1;
+    if ((arity[np->op] > 0 && (np->a < 0 || np->a >= i)) ||
+        (arity[np->op] > 1 && (np->b < 0 || np->b >= i)) ||
+        (arity[np->op] > 2 && (np->c < 0 || np->c >= i)))
+      return -1;
+    if (np->op == AVAR && (np->num < 0 || (uintmax_t)np->num >= names))
+      return -1;
+    if (((np->op >= APREINC && np->op <= APOSTDEC) || np->op == AASSIGN) &&
+        c->node[np->a].op != AVAR)
+      return -1;
+    if (np->op == AASSIGN && np->c != AASSIGN &&
+        (np->c < AMUL || np->c > ABOR))
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * evaluation
+ */
+
+static intmax_t varnum(const char *name) {
+  const char *v = lookupvar(name);
+  intmax_t n;
+
+  if (!v || !*v)
+    return 0;
+  if (atomax(v, 0, &n))
+    badnum(v);
+  return n;
+}
+
+static void setnum(const char *name, intmax_t n) {
+  char buf[32];
+
+  snprintf(buf, sizeof(buf), "%" PRIdMAX, n);
+  setvar(name, buf, 0);
+}
+
+/* overflow wraps around rather than being undefined */
+static intmax_t binop(int op, intmax_t x, intmax_t y) {
+  switch (op) {
+  case ADIV:
+  case AMOD:
+    if (y == 0)
+      raiseerr("division by zero");
+    if (y == -1)
+      return op == ADIV ? (intmax_t)-(uintmax_t)x : 0;
+    return op == ADIV ? x / y : x % y;
+  case AMUL:
+    return (uintmax_t)x * y;
+  case AADD:
+    return (uintmax_t)x + y;
+  case ASUB:
+    return (uintmax_t)x - y;
+  case ASHL:
+    return (uintmax_t)x << (y & (sizeof(x) * 8 - 1));
+  case ASHR:
+    return x >> (y & (sizeof(x) * 8 - 1));
+  case ALT:
+    return x < y;
+  case ALE:
+    return x <= y;
+  case AGT:
+    return x > y;
+  case AGE:
+    return x >= y;
+  case AEQ:
+    return x == y;
+  case ANE:
+    return x != y;
+  case ABAND:
+    return x & y;
+  case ABXOR:
+    return x ^ y;
+  default:
+    return x | y;
+  }
+}
+
+static intmax_t evalnode(const struct carith *c, int i) {
+  const struct anode *np = &c->node[i];
+  const char *name;
+  intmax_t x, y;
+
+  switch (np->op) {
+  case ANUM:
+    return np->num;
+  case AVAR:
+    return varnum(NAMES(c) + np->num);
+  case ANEG:
+    return -(uintmax_t)evalnode(c, np->a);
+  case ANOT:
+    return !evalnode(c, np->a);
+  case ACOMPL:
+    return ~evalnode(c, np->a);
+  case APREINC:
+  case APREDEC:
+  case APOSTINC:
+  case APOSTDEC:
+    name = NAMES(c) + c->node[np->a].num;
+    x    = varnum(name);
+    y    = (uintmax_t)x + (np->op == APREINC || np->op == APOSTINC ? 1 : -1);
+    setnum(name, y);
+    return np->op == APREINC || np->op == APREDEC ? y : x;
+  case AAND:
+    return evalnode(c, np->a) && evalnode(c, np->b);
+  case AOR:
+    return evalnode(c, np->a) || evalnode(c, np->b);
+  case ACOND:
+    return evalnode(c, np->a) ? evalnode(c, np->b) : evalnode(c, np->c);
+  case AASSIGN:
+    name = NAMES(c) + c->node[np->a].num;
+    y    = evalnode(c, np->b);
+    if (np->c != AASSIGN)
+      y = binop(np->c, varnum(name), y);
+    setnum(name, y);
+    return y;
+  case ACOMMA:
+    evalnode(c, np->a);
+    return evalnode(c, np->b);
+  default:
+    x = evalnode(c, np->a);
+    return binop(np->op, x, evalnode(c, np->b));
+  }
+}
+
+intmax_t arith(const struct carith *c) { return evalnode(c, c->nnodes - 1); }
+
+/* Parses and evaluates the expression s, raising any error. */
+intmax_t arithstr(const char *s) {
+  struct carith *c;
+  const char *err = NULL;
+
+  if (!(c = arithparse(s, &err)))
+    raiseerr("$((%s)): %s", s, err);
+  return arith(c);
+}
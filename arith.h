@@ -0,0 +1,17 @@
+/*
+ * \file arith.h
+ */
+
+#ifndef ARITH_H
+#define ARITH_H
+
+#include <stdint.h>
+
+#include "cmd.h"
+
+struct carith *arithparse(const char *, const char **err);
+int arithcheck(const struct carith *);
+intmax_t arith(const struct carith *);
+intmax_t arithstr(const char *);
+
+#endif
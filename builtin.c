@@ -10,57 +10,69 @@
 #include "builtin.h"
 #include "cmd.h"
 #include "eval.h"
+#include "input.h"
 #include "lexer.h"
 #include "options.h"
 #include "output.h"
 #include "str.h"
 #include "var.h"
 
-#define LEN(a)     (sizeof(a) / sizeof(a[0]))
-#define N_BUILTINS LEN(builtins)
-
-/* must be listed in alphabetical order for bsearch */
-static struct builtin builtins[] = {
-    {".",        source_builtin,  BUILTIN_SPECIAL                 },
-    {":",        true_builtin,    BUILTIN_SPECIAL                 },
-    {"args",     args_builtin,    0                               },
-    {"break",    break_builtin,   BUILTIN_SPECIAL                 },
-    {"builtin",  builtin_builtin, 0                               },
-    {"cd",       cd_builtin,      0                               },
-    {"command",  command_builtin, 0                               },
-    {"continue", break_builtin,   BUILTIN_SPECIAL                 },
-    {"echo",     echo_builtin,    0                               },
-    {"eval",     eval_builtin,    BUILTIN_SPECIAL                 },
-    {"exec",     exec_builtin,    BUILTIN_SPECIAL                 },
-    {"exit",     exit_builtin,    BUILTIN_SPECIAL                 },
-    {"export",   export_builtin,  BUILTIN_SPECIAL | BUILTIN_ASSIGN},
-    {"false",    true_builtin,    0                               },
-    {"fg",       fg_builtin,      0                               },
-    {"local",    local_builtin,   BUILTIN_SPECIAL | BUILTIN_ASSIGN},
-    {"read",     read_builtin,    0                               },
-    {"readonly", export_builtin,  BUILTIN_SPECIAL | BUILTIN_ASSIGN},
-    {"return",   return_builtin,  BUILTIN_SPECIAL                 },
-    {"set",      set_builtin,     BUILTIN_SPECIAL                 },
-    {"shift",    shift_builtin,   BUILTIN_SPECIAL                 },
-    {"source",   source_builtin,  0                               },
-    {"tokens",   tokens_builtin,  0                               },
-    {"true",     true_builtin,    0                               },
-    {"unset",    unset_builtin,   BUILTIN_SPECIAL                 },
+/*
+ * Perfect hash over the builtin names, keyed on the length and the first and
+ * last character. Slots are computed at compile time by the designated
+ * initializers below; a new builtin must land in an empty slot, which
+ * -Woverride-init checks for us.
+ */
+#define BLTNHASHSIZE 64
+#define BLTNHASH(len, first, last)                                             \
+  (((len) * 11 + ((unsigned char)(first)) * 24 + (unsigned char)(last)) &      \
+   (BLTNHASHSIZE - 1))
+#define BLTN(name, first, last, func, flags)                                   \
+  [BLTNHASH(sizeof(name) - 1, first, last)] = {name, func, flags}
+
+static struct builtin builtins[BLTNHASHSIZE] = {
+    BLTN(".",        '.', '.', source_builtin,  BUILTIN_SPECIAL | BUILTIN_EVAL),
+    BLTN(":",        ':', ':', true_builtin,    BUILTIN_SPECIAL),
+    BLTN("args",     'a', 's', args_builtin,    0),
+    BLTN("break",    'b', 'k', break_builtin,   BUILTIN_SPECIAL),
+    BLTN("builtin",  'b', 'n', builtin_builtin, BUILTIN_EVAL),
+    BLTN("cd",       'c', 'd', cd_builtin,      0),
+    BLTN("command",  'c', 'd', command_builtin, 0),
+    BLTN("continue", 'c', 'e', break_builtin,   BUILTIN_SPECIAL),
+    BLTN("echo",     'e', 'o', echo_builtin,    0),
+    BLTN("eval",     'e', 'l', eval_builtin,    BUILTIN_SPECIAL | BUILTIN_EVAL),
+    BLTN("exec",     'e', 'c', exec_builtin,    BUILTIN_SPECIAL),
+    BLTN("exit",     'e', 't', exit_builtin,    BUILTIN_SPECIAL),
+    BLTN("export",   'e', 't', export_builtin,  BUILTIN_SPECIAL | BUILTIN_ASSIGN),
+    BLTN("false",    'f', 'e', true_builtin,    0),
+    BLTN("fg",       'f', 'g', fg_builtin,      0),
+    BLTN("local",    'l', 'l', local_builtin,   BUILTIN_SPECIAL | BUILTIN_ASSIGN),
+    BLTN("read",     'r', 'd', read_builtin,    0),
+    BLTN("readonly", 'r', 'y', export_builtin,  BUILTIN_SPECIAL | BUILTIN_ASSIGN),
+    BLTN("return",   'r', 'n', return_builtin,  BUILTIN_SPECIAL),
+    BLTN("set",      's', 't', set_builtin,     BUILTIN_SPECIAL),
+    BLTN("shift",    's', 't', shift_builtin,   BUILTIN_SPECIAL),
+    BLTN("source",   's', 'e', source_builtin,  BUILTIN_EVAL),
+    BLTN("tokens",   't', 's', tokens_builtin,  0),
+    BLTN("true",     't', 'e', true_builtin,    0),
+    BLTN("unset",    'u', 't', unset_builtin,   BUILTIN_SPECIAL),
 };
 
-static int builtincmp(const void *v1, const void *v2) {
-  struct builtin *b1 = (struct builtin *)v1;
-  struct builtin *b2 = (struct builtin *)v2;
-  return strcmp(b1->name, b2->name);
-}
-
 /*
  * return the builtin function associated
  * with a name, or NULL if not found
  */
 struct builtin *get_builtin(const char *name) {
-  return bsearch(&name, builtins, N_BUILTINS, sizeof(struct builtin),
-                 builtincmp);
+  size_t len = strlen(name);
+  struct builtin *b;
+
+  if (len == 0)
+    return NULL;
+
+  b = &builtins[BLTNHASH(len, name[0], name[len - 1])];
+  if (b->name && strcmp(b->name, name) == 0)
+    return b;
+  return NULL;
 }
 
 int echo_builtin(int argc, char **argv) {
@@ -129,6 +141,8 @@ int exit_builtin(int argc, char **argv) {
 /* exec a program to replace the shell */
 int exec_builtin(int argc, char **argv) {
   if (argc > 1) {
+    /* the program gets stdin from where the script is parsed to */
+    syncstdin();
     execvp(argv[1], argv + 1);
     /* if error */
     perrorf("exec: %s: command not found", argv[1]);
@@ -195,7 +209,7 @@ int command_builtin(int argc, char **argv) {
   if (argc == 0)
     return 0;
 
-  return runprog(argv);
+  return runprog(argv, NULL);
 }
 
 int tokens_builtin(int argc, char **argv) {
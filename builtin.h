@@ -8,6 +8,7 @@
 
 #define BUILTIN_SPECIAL (1 << 1)
 #define BUILTIN_ASSIGN  (1 << 2)
+#define BUILTIN_EVAL    (1 << 3) /* runs code that may change $@ under it */
 
 typedef int (*builtin_func)(int argc, char** argv);
 
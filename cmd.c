@@ -1,25 +1,37 @@
 
 #include <assert.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "cmd.h"
 #include "mem.h"
 #include "output.h"
 
 const char *cmdname[] = {
-    "exec",  "pipe",  "bang", "and",        "or", "sub",  "brace", "redir",
-    "while", "until", "list", "background", "if", "func", "case",  NULL,
+    "exec",  "pipe",  "bang", "and",        "or", "sub", "brace", "redir",
+    "while", "until", "list", "background", "if", "for", "func",  "case",
+    "seq",   "lazy",  "arith", NULL,
 };
 
 #define LEN(a) (sizeof(a) / sizeof(*a))
-static_assert(LEN(cmdname) == CMAX, "cmdname has the wrong size");
+static_assert(LEN(cmdname) == CMAX + 1, "cmdname has the wrong size");
 
-static inline void freeargs(struct arg *);
-static inline struct arg *copyargs(struct arg *);
+long ncmdnodes;
+
+/* every parsed node comes through here, so --parse-stats can count them */
+static inline void *cmdalloc(size_t n) {
+  ncmdnodes++;
+  return stalloc(n);
+}
+
+static inline int isbinary(int type) {
+  return type == CPIPE || type == CAND || type == COR || type == CLIST ||
+         type == CBGND;
+}
 
 struct cmd *execcmd() {
   struct cexec *cmd;
-  cmd       = stalloc(sizeof(*cmd));
+  cmd       = cmdalloc(sizeof(*cmd));
   cmd->type = CEXEC;
   cmd->argc = 0;
   cmd->argv = NULL;
@@ -28,7 +40,7 @@ struct cmd *execcmd() {
 
 struct cmd *bincmd(int c, struct cmd *left, struct cmd *right) {
   struct cbinary *cmd;
-  cmd        = stalloc(sizeof(*cmd));
+  cmd        = cmdalloc(sizeof(*cmd));
   cmd->type  = c;
   cmd->left  = left;
   cmd->right = right;
@@ -37,26 +49,34 @@ struct cmd *bincmd(int c, struct cmd *left, struct cmd *right) {
 
 struct cmd *unrycmd(int c, struct cmd *subcmd) {
   struct cunary *cmd;
-  cmd       = stalloc(sizeof(*cmd));
+  cmd       = cmdalloc(sizeof(*cmd));
   cmd->type = c;
   cmd->cmd  = subcmd;
   return (struct cmd *)cmd;
 }
 
-struct cmd *redircmd(struct cmd *subcmd, struct arg *fname, int mode, int fd) {
+/* the caller fills in the n commands */
+struct cmd *seqcmd(int n) {
+  struct cseq *cmd;
+  cmd       = cmdalloc(sizeof(*cmd) + n * sizeof(*cmd->cmd));
+  cmd->type = CSEQ;
+  cmd->n    = n;
+  return (struct cmd *)cmd;
+}
+
+/* the caller fills in the nredir redirections */
+struct cmd *redircmd(struct cmd *subcmd, int nredir) {
   struct credir *cmd;
-  cmd        = stalloc(sizeof(*cmd));
-  cmd->type  = CREDIR;
-  cmd->cmd   = subcmd;
-  cmd->fname = fname;
-  cmd->mode  = mode;
-  cmd->fd    = fd;
+  cmd         = cmdalloc(sizeof(*cmd) + nredir * sizeof(*cmd->redir));
+  cmd->type   = CREDIR;
+  cmd->nredir = nredir;
+  cmd->cmd    = subcmd;
   return (struct cmd *)cmd;
 }
 
 struct cmd *loopcmd(int op, struct cmd *cond, struct cmd *body) {
   struct cloop *cmd;
-  cmd       = stalloc(sizeof(*cmd));
+  cmd       = cmdalloc(sizeof(*cmd));
   cmd->type = op;
   cmd->cond = cond;
   cmd->body = body;
@@ -65,7 +85,7 @@ struct cmd *loopcmd(int op, struct cmd *cond, struct cmd *body) {
 
 struct cmd *ifcmd(struct cmd *cond, struct cmd *ifp, struct cmd *elsep) {
   struct cif *cmd;
-  cmd           = stalloc(sizeof(*cmd));
+  cmd           = cmdalloc(sizeof(*cmd));
   cmd->type     = CIF;
   cmd->cond     = cond;
   cmd->ifpart   = ifp;
@@ -75,7 +95,7 @@ struct cmd *ifcmd(struct cmd *cond, struct cmd *ifp, struct cmd *elsep) {
 
 struct cmd *forcmd(char *var, struct arg *args, struct cmd *body) {
   struct cfor *cmd;
-  cmd       = stalloc(sizeof(*cmd));
+  cmd       = cmdalloc(sizeof(*cmd));
   cmd->type = CFOR;
   cmd->var  = var;
   cmd->list = args;
@@ -85,7 +105,7 @@ struct cmd *forcmd(char *var, struct arg *args, struct cmd *body) {
 
 struct cmd *casecmd(struct arg *expr, struct cases *cases) {
   struct ccase *cmd;
-  cmd       = stalloc(sizeof(*cmd));
+  cmd       = cmdalloc(sizeof(*cmd));
   cmd->type = CCASE;
   cmd->expr = expr;
   cmd->list = cases;
@@ -94,64 +114,155 @@ struct cmd *casecmd(struct arg *expr, struct cases *cases) {
 
 struct cmd *funccmd(char *name, struct cmd *body) {
   struct cfunc *cmd;
-  cmd       = stalloc(sizeof(*cmd));
+  cmd       = cmdalloc(sizeof(*cmd));
   cmd->type = CFUNC;
   cmd->name = name;
   cmd->body = body;
   return (struct cmd *)cmd;
 }
 
+/* the caller fills in the len bytes of text */
+struct cmd *lazycmd(int len, int lineno, const char *fname) {
+  struct clazy *cmd;
+  size_t n       = strlen(fname) + 1;
+  cmd            = cmdalloc(sizeof(*cmd) + len + 1 + n);
+  cmd->type      = CLAZY;
+  cmd->lineno    = lineno;
+  cmd->fname     = memcpy(cmd->text + len + 1, fname, n);
+  cmd->text[len] = '\0';
+  return (struct cmd *)cmd;
+}
+
+/* the caller fills in the n nodes and namelen bytes of names */
+struct cmd *arithcmd(int n, int namelen) {
+  struct carith *cmd;
+  size_t size = sizeof(*cmd) + n * sizeof(*cmd->node) + namelen;
+
+  cmd         = cmdalloc(size);
+  cmd->type   = CARITH;
+  cmd->size   = size;
+  cmd->nnodes = n;
+  cmd->expr   = NULL;
+  return (struct cmd *)cmd;
+}
+
+/*
+ * Saved trees
+ *
+ * copycmd() puts a tree in a single malloc'ed block: nodes in preorder,
+ * each followed by its words and strings, so a saved tree runs forward
+ * through memory. The root is at the start of the block and freecmd()
+ * is one free(). The tree is walked twice, once to size the block and once
+ * to fill it.
+ */
+
+static char *abase; /* block being filled, NULL while sizing */
+static size_t alen;
+
+/* nodes land here while sizing, so copies must never be read back */
+static union {
+  struct cexec ce;
+  struct cbinary cb;
+  struct credir cr;
+  struct cloop cl;
+  struct cif ci;
+  struct cfor cf;
+  struct ccase cc;
+  struct cfunc cfn;
+  struct carith ca;
+  struct cases cs;
+  struct arg ap;
+} scratch;
+
+static struct cmd *savecmd(struct cmd *);
+
+static void *aalloc(size_t n) {
+  size_t off = MEMALIGN(alen);
+
+  alen = off + n;
+  return abase ? abase + off : (void *)&scratch;
+}
+
+static char *astrdup(const char *s) {
+  size_t n = strlen(s) + 1;
+  char *p  = abase ? abase + alen : NULL;
+
+  if (p)
+    memcpy(p, s, n);
+  alen += n;
+  return p;
+}
+
 static inline struct arg *copyargs(struct arg *ap) {
-  struct arg *bp, **bpp = &bp;
+  struct arg *bp, *cp, **bpp = &bp;
 
   while (ap) {
-    *bpp          = xmalloc(sizeof(**bpp));
-    (*bpp)->text  = xstrdup(ap->text);
-    (*bpp)->subst = (struct cbinary *)copycmd((struct cmd *)ap->subst);
-    bpp           = &(*bpp)->next;
-    ap            = ap->next;
+    *bpp      = cp = aalloc(sizeof(*cp));
+    cp->text  = astrdup(ap->text);
+    cp->flags = ap->flags;
+    cp->subst = (struct cbinary *)savecmd((struct cmd *)ap->subst);
+    bpp       = &cp->next;
+    ap        = ap->next;
   }
   *bpp = NULL;
   return bp;
 }
 
-struct cases *copycases(struct cases *ac) {
-  struct cases *cp, **cpp = &cp;
+static struct cases *copycases(struct cases *ac) {
+  struct cases *cp, *cc, **cpp = &cp;
 
   while (ac) {
-    *cpp                = xmalloc(sizeof(*cp));
-    (*cpp)->cmd         = copycmd(ac->cmd);
-    (*cpp)->fallthrough = ac->fallthrough;
-    (*cpp)->patterns    = copyargs(ac->patterns);
-    cpp                 = &(*cpp)->next;
-    ac                  = ac->next;
+    *cpp            = cc = aalloc(sizeof(*cc));
+    cc->fallthrough = ac->fallthrough;
+    cc->patterns    = copyargs(ac->patterns);
+    cc->cmd         = savecmd(ac->cmd);
+    cpp             = &cc->next;
+    ac              = ac->next;
   }
   *cpp = NULL;
   return cp;
 }
 
-struct cmd *copycmd(struct cmd *c) {
+static struct cmd *savecmd(struct cmd *c) {
   if (!c)
     return NULL;
 
   struct cexec *ce, *cce;
   struct cbinary *cb, *ccb;
   struct cunary *cu, *ccu;
+  struct cseq *cs, *ccs;
   struct credir *cr, *ccr;
   struct cloop *cl, *ccl;
   struct cif *ci, *cci;
   struct cfor *cf, *ccf;
   struct ccase *cc, *ccc;
   struct cfunc *cfn, *ccfn;
+  struct clazy *cz, *ccz;
+  struct carith *ca, *cca;
+  struct cmd *cc0, **cpp;
+  struct arg *ap;
+  char **av;
+  size_t n;
+  int i;
 
   switch (c->type) {
   case CEXEC:
     ce  = (struct cexec *)c;
-    cce = xmalloc(sizeof(*cce));
+    cce = aalloc(sizeof(*cce));
 
     cce->type = ce->type;
     cce->argc = ce->argc;
     cce->args = copyargs(ce->args);
+    cce->argv = NULL;
+    if (ce->argv) {
+      av = aalloc(sizeof(*av) * (ce->argc + 1));
+      if (abase) {
+        cce->argv = av;
+        for (ap = cce->args; ap; ap = ap->next)
+          *av++ = ap->text;
+        *av = NULL;
+      }
+    }
     return (struct cmd *)cce;
 
   case CPIPE:
@@ -159,68 +270,95 @@ struct cmd *copycmd(struct cmd *c) {
   case COR:
   case CLIST:
   case CBGND:
-    cb  = (struct cbinary *)c;
-    ccb = xmalloc(sizeof(*ccb));
-
-    ccb->type  = cb->type;
-    ccb->left  = copycmd(cb->left);
-    ccb->right = copycmd(cb->right);
-    return (struct cmd *)ccb;
+    /* lists are left-deep and can be very long, walk the spine */
+    for (cpp = &cc0;; c = cb->left) {
+      cb  = (struct cbinary *)c;
+      ccb = aalloc(sizeof(*ccb));
+
+      ccb->type  = cb->type;
+      ccb->right = savecmd(cb->right);
+      *cpp       = (struct cmd *)ccb;
+      cpp        = &ccb->left;
+      if (!cb->left || !isbinary(cb->left->type))
+        break;
+    }
+    *cpp = savecmd(cb->left);
+    return cc0;
+
+  case CSEQ:
+    cs  = (struct cseq *)c;
+    ccs = aalloc(sizeof(*ccs) + cs->n * sizeof(*cs->cmd));
+
+    ccs->type = cs->type;
+    ccs->n    = cs->n;
+    for (i = 0; i < cs->n; i++) {
+      cc0 = savecmd(cs->cmd[i]);
+      /* the vector does not fit in scratch */
+      if (abase)
+        ccs->cmd[i] = cc0;
+    }
+    return (struct cmd *)ccs;
 
   case CBANG:
   case CSUB:
   case CBRC:
     cu  = (struct cunary *)c;
-    ccu = xmalloc(sizeof(*ccu));
+    ccu = aalloc(sizeof(*ccu));
 
     ccu->type = cu->type;
-    ccu->cmd  = copycmd(cu->cmd);
+    ccu->cmd  = savecmd(cu->cmd);
     return (struct cmd *)ccu;
 
   case CREDIR:
     cr  = (struct credir *)c;
-    ccr = xmalloc(sizeof(*ccr));
-
-    ccr->type  = cr->type;
-    ccr->cmd   = copycmd(cr->cmd);
-    ccr->fname = copyargs(cr->fname);
-    ccr->mode  = cr->mode;
-    ccr->fd    = cr->fd;
+    ccr = aalloc(sizeof(*ccr) + cr->nredir * sizeof(*cr->redir));
+
+    ccr->type   = cr->type;
+    ccr->nredir = cr->nredir;
+    for (i = 0; i < cr->nredir; i++) {
+      ap = copyargs(cr->redir[i].fname);
+      /* the vector does not fit in scratch */
+      if (abase) {
+        ccr->redir[i]       = cr->redir[i];
+        ccr->redir[i].fname = ap;
+      }
+    }
+    ccr->cmd = savecmd(cr->cmd);
     return (struct cmd *)ccr;
 
   case CWHILE:
   case CUNTIL:
     cl  = (struct cloop *)c;
-    ccl = xmalloc(sizeof(*ccl));
+    ccl = aalloc(sizeof(*ccl));
 
     ccl->type = cl->type;
-    ccl->cond = copycmd(cl->cond);
-    ccl->body = copycmd(cl->body);
+    ccl->cond = savecmd(cl->cond);
+    ccl->body = savecmd(cl->body);
     return (struct cmd *)ccl;
 
   case CIF:
     ci  = (struct cif *)c;
-    cci = xmalloc(sizeof(*cci));
+    cci = aalloc(sizeof(*cci));
 
     cci->type     = ci->type;
-    cci->cond     = copycmd(ci->cond);
-    cci->ifpart   = copycmd(ci->ifpart);
-    cci->elsepart = copycmd(ci->elsepart);
+    cci->cond     = savecmd(ci->cond);
+    cci->ifpart   = savecmd(ci->ifpart);
+    cci->elsepart = savecmd(ci->elsepart);
     return (struct cmd *)cci;
 
   case CFOR:
     cf  = (struct cfor *)c;
-    ccf = xmalloc(sizeof(*ccf));
+    ccf = aalloc(sizeof(*ccf));
 
     ccf->type = cf->type;
-    ccf->var  = xstrdup(cf->var);
+    ccf->var  = astrdup(cf->var);
     ccf->list = copyargs(cf->list);
-    ccf->body = copycmd(cf->body);
+    ccf->body = savecmd(cf->body);
     return (struct cmd *)ccf;
 
   case CCASE:
     cc  = (struct ccase *)c;
-    ccc = xmalloc(sizeof(*ccc));
+    ccc = aalloc(sizeof(*ccc));
 
     ccc->type = cc->type;
     ccc->expr = copyargs(cc->expr);
@@ -229,128 +367,55 @@ struct cmd *copycmd(struct cmd *c) {
 
   case CFUNC:
     cfn  = (struct cfunc *)c;
-    ccfn = xmalloc(sizeof(*ccfn));
+    ccfn = aalloc(sizeof(*ccfn));
 
     ccfn->type = cfn->type;
-    ccfn->name = xstrdup(cfn->name);
-    ccfn->body = copycmd(cfn->body);
+    ccfn->name = astrdup(cfn->name);
+    ccfn->body = savecmd(cfn->body);
     return (struct cmd *)ccfn;
 
-  default:
-    die("unknown command type: %d\n", c->type);
-  }
-}
+  case CLAZY:
+    cz  = (struct clazy *)c;
+    n   = strlen(cz->text) + 1;
+    ccz = aalloc(sizeof(*ccz) + n);
 
-static inline void freeargs(struct arg *ap) {
-  struct arg *next;
+    ccz->type   = cz->type;
+    ccz->lineno = cz->lineno;
+    if (abase)
+      memcpy(ccz->text, cz->text, n);
+    ccz->fname = astrdup(cz->fname);
+    return (struct cmd *)ccz;
 
-  while (ap) {
-    next = ap->next;
-    free(ap->text);
-    freecmd((struct cmd *)ap->subst);
-    free(ap);
-    ap = next;
-  }
-}
+  case CARITH:
+    /* the nodes hold no pointers, only the word to expand does */
+    ca  = (struct carith *)c;
+    cca = aalloc(ca->size);
+
+    if (abase)
+      memcpy(cca, ca, ca->size);
+    cca->expr = copyargs(ca->expr);
+    return (struct cmd *)cca;
 
-static inline void freecases(struct cases *cp) {
-  struct cases *next;
-  while (cp) {
-    next = cp->next;
-    freeargs(cp->patterns);
-    freecmd(cp->cmd);
-    free(cp);
-    cp = next;
+  default:
+    die("unknown command type: %d\n", c->type);
   }
 }
 
-void freecmd(struct cmd *c) {
-  if (!c)
-    return;
-
-  struct cexec *ce;
-  struct cbinary *cb;
-  struct cunary *cu;
-  struct credir *cr;
-  struct cloop *cl;
-  struct cif *ci;
-  struct cfor *cf;
-  struct ccase *cc;
-  struct cfunc *cfn;
-
-  switch (c->type) {
-  case CEXEC:
-    ce = (struct cexec *)c;
-
-    freeargs(ce->args);
-    break;
-
-  case CPIPE:
-  case CAND:
-  case COR:
-  case CLIST:
-  case CBGND:
-    cb = (struct cbinary *)c;
-
-    freecmd(cb->left);
-    freecmd(cb->right);
-    break;
-
-  case CBANG:
-  case CSUB:
-  case CBRC:
-    cu = (struct cunary *)c;
-
-    freecmd(cu->cmd);
-    break;
-
-  case CREDIR:
-    cr = (struct credir *)c;
-
-    freecmd(cr->cmd);
-    freeargs(cr->fname);
-    break;
-
-  case CWHILE:
-  case CUNTIL:
-    cl = (struct cloop *)c;
-
-    freecmd(cl->cond);
-    freecmd(cl->body);
-    break;
-
-  case CIF:
-    ci = (struct cif *)c;
-
-    freecmd(ci->cond);
-    freecmd(ci->ifpart);
-    freecmd(ci->elsepart);
-    break;
-
-  case CFOR:
-    cf = (struct cfor *)c;
-
-    free(cf->var);
-    freeargs(cf->list);
-    freecmd(cf->body);
-    break;
-
-  case CCASE:
-    cc = (struct ccase *)c;
-    freeargs(cc->expr);
-    freecases(cc->list);
-    break;
+struct cmd *copycmd(struct cmd *c) {
+  struct cmd *cc;
 
-  case CFUNC:
-    cfn = (struct cfunc *)c;
+  if (!c)
+    return NULL;
 
-    free(cfn->name);
-    freecmd(cfn->body);
-    break;
+  abase = NULL;
+  alen  = 0;
+  savecmd(c);
 
-  default:
-    die("unknown command type: %d\n", c->type);
-  }
-
-  free(c);
+  abase = xmalloc(alen);
+  alen  = 0;
+  cc    = savecmd(c);
+  abase = NULL;
+  return cc;
 }
+
+void freecmd(struct cmd *c) { free(c); }
@@ -2,6 +2,8 @@
 #ifndef CMD_H
 #define CMD_H
 
+#include <stdint.h>
+
 #define CEXEC  0
 #define CPIPE  1
 #define CBANG  2
@@ -18,7 +20,10 @@
 #define CFOR   13
 #define CFUNC  14
 #define CCASE  15
-#define CMAX   16
+#define CSEQ   16
+#define CLAZY  17
+#define CARITH 18
+#define CMAX   19
 
 struct cmd {
   int type;
@@ -27,14 +32,19 @@ struct cmd {
 struct cexec {
   int type;
   int argc;
-  char **argv;
+  char **argv; /* ready to run if every word is literal, else NULL */
   struct arg *args;
 };
 
+#define ARG_LITERAL (1 << 0) /* expands to its own text */
+#define ARG_GLOB    (1 << 1) /* expanded, with unquoted *?[ to match files */
+#define ARG_ESCAPED (1 << 2) /* expanded, with backslashes still to remove */
+
 struct arg {
   char *text;
   struct arg *next;
   struct cbinary *subst;
+  int flags;
 };
 
 struct cbinary {
@@ -48,14 +58,27 @@ struct cunary {
   struct cmd *cmd;
 };
 
-struct credir {
+/* a list of commands run in order, kept flat so it is walked in a loop */
+struct cseq {
   int type;
-  struct cmd *cmd;
+  int n;
+  struct cmd *cmd[];
+};
+
+struct redir {
   struct arg *fname;
-  int mode;
+  int mode; /* <, > or + (>>), h for a here-document, s for <<< */
   int fd;
 };
 
+/* all the redirections of a command, applied in order */
+struct credir {
+  int type;
+  int nredir;
+  struct cmd *cmd;
+  struct redir redir[];
+};
+
 struct cloop {
   int type;
   struct cmd *cond;
@@ -95,16 +118,52 @@ struct cfunc {
   struct cmd *body;
 };
 
+/*
+ * A function body not parsed yet, its source text from { to } and a \n. The
+ * name of the file it came from follows the text.
+ */
+struct clazy {
+  int type;
+  int lineno;
+  char *fname;
+  char text[];
+};
+
+/* one operator or operand of a $((...)), see arith.c */
+struct anode {
+  int op;
+  int a, b, c;  /* operands, earlier nodes of the same expression */
+  intmax_t num; /* a constant, or where the name of a variable starts */
+};
+
+/*
+ * A $((...)) in the substitutions of a word. Its nodes come children first,
+ * the root last, and are followed by the variable names. If the text has
+ * anything to expand, expr holds it and it is parsed each time instead.
+ */
+struct carith {
+  int type;
+  int size; /* bytes of the whole node */
+  int nnodes;
+  struct arg *expr;
+  struct anode node[];
+};
+
 /* constructors */
+extern long ncmdnodes; /* nodes built so far */
+
 struct cmd *execcmd(void);
 struct cmd *bincmd(int, struct cmd *, struct cmd *);
 struct cmd *unrycmd(int, struct cmd *);
-struct cmd *redircmd(struct cmd *, struct arg *, int, int);
+struct cmd *seqcmd(int);
+struct cmd *redircmd(struct cmd *, int);
 struct cmd *loopcmd(int, struct cmd *, struct cmd *);
 struct cmd *ifcmd(struct cmd *, struct cmd *, struct cmd *);
 struct cmd *forcmd(char *, struct arg *, struct cmd *);
 struct cmd *casecmd(struct arg *expr, struct cases *cases);
 struct cmd *funccmd(char *, struct cmd *);
+struct cmd *lazycmd(int, int, const char *);
+struct cmd *arithcmd(int, int);
 
 /* deepcopy */
 struct cmd *copycmd(struct cmd *);
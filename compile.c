@@ -0,0 +1,708 @@
+/** \file compile.c
+ *
+ * Precompiled scripts.
+ *
+ * `sh --compile script` parses the script and writes its command trees to
+ * script.shc. The trees are stored as the usual structs, but every pointer
+ * holds the offset of its target within the file instead. Nodes are laid
+ * out children first, so every offset points below the node holding it.
+ *
+ * When the shell runs a script with an up to date .shc next to it, the
+ * image is mapped privately and the offsets are turned back into pointers
+ * in place. The parser then hands out the mapped commands instead of
+ * lexing the source.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arith.h"
+#include "cmd.h"
+#include "compile.h"
+#include "error.h"
+#include "input.h"
+#include "mem.h"
+#include "output.h"
+#include "parser.h"
+
+#define SHCMAGIC   "dmshc\0\0\6"
+#define SHCBOM     0x01020304
+#define SHCSUFFIX  ".shc"
+
+struct shchdr {
+  char magic[8];
+  uint32_t bom;     /* byte order and pointer size of the writer */
+  uint32_t ptrsize;
+  uint64_t size;    /* of the image */
+  uint64_t srcsize; /* identity of the source file */
+  int64_t srcmtime;
+  int64_t srcmtimens;
+  uint64_t cmdtab; /* offset of the struct compiled array */
+  uint64_t ncmds;
+};
+
+/*
+ * writing
+ */
+
+static char *obuf;
+static size_t olen;
+static size_t ocap;
+
+#define OFF(off) ((void *)(uintptr_t)(off))
+
+/* reserve n zeroed bytes in the image, return their offset */
+static size_t oalloc(size_t n) {
+  size_t off = olen;
+
+  n = MEMALIGN(n);
+  if (olen + n > ocap) {
+    while (olen + n > ocap)
+      ocap = ocap ? ocap * 2 : BUFSIZ;
+    obuf = xrealloc(obuf, ocap);
+  }
+  memset(obuf + off, 0, n);
+  olen += n;
+  return off;
+}
+
+#define ONODE(type, off) ((type *)(obuf + (off)))
+
+static size_t putcmd(struct cmd *);
+
+static size_t putstr(const char *s) {
+  size_t len, off;
+
+  if (!s)
+    return 0;
+  len = strlen(s) + 1;
+  off = oalloc(len);
+  memcpy(obuf + off, s, len);
+  return off;
+}
+
+static size_t putargs(struct arg *ap) {
+  size_t off, next, text, subst;
+
+  if (!ap)
+    return 0;
+
+  next  = putargs(ap->next);
+  text  = putstr(ap->text);
+  subst = putcmd((struct cmd *)ap->subst);
+  off   = oalloc(sizeof(struct arg));
+
+  ONODE(struct arg, off)->text  = OFF(text);
+  ONODE(struct arg, off)->next  = OFF(next);
+  ONODE(struct arg, off)->subst = OFF(subst);
+  ONODE(struct arg, off)->flags = ap->flags;
+  return off;
+}
+
+static size_t putcases(struct cases *cp) {
+  size_t off, next, patterns, cmd;
+
+  if (!cp)
+    return 0;
+
+  next     = putcases(cp->next);
+  patterns = putargs(cp->patterns);
+  cmd      = putcmd(cp->cmd);
+  off      = oalloc(sizeof(struct cases));
+
+  ONODE(struct cases, off)->fallthrough = cp->fallthrough;
+  ONODE(struct cases, off)->patterns    = OFF(patterns);
+  ONODE(struct cases, off)->cmd         = OFF(cmd);
+  ONODE(struct cases, off)->next        = OFF(next);
+  return off;
+}
+
+static inline int isbinary(int type) {
+  return type == CPIPE || type == CAND || type == COR || type == CLIST ||
+         type == CBGND;
+}
+
+/* lists are left-deep and can be very long, so the spine is done by hand */
+static size_t putlist(struct cbinary *cb) {
+  size_t n, i, off, left, right;
+  struct cbinary **spine;
+  struct cmd *c;
+
+  for (n = 0, c = (struct cmd *)cb; c && isbinary(c->type); n++)
+    c = ((struct cbinary *)c)->left;
+  spine = xmalloc(n * sizeof(*spine));
+  for (i = 0, c = (struct cmd *)cb; i < n; i++) {
+    spine[i] = (struct cbinary *)c;
+    c        = spine[i]->left;
+  }
+
+  left = putcmd(c);
+  for (i = n; i-- > 0;) {
+    right = putcmd(spine[i]->right);
+    off   = oalloc(sizeof(struct cbinary));
+
+    ONODE(struct cbinary, off)->type  = spine[i]->type;
+    ONODE(struct cbinary, off)->left  = OFF(left);
+    ONODE(struct cbinary, off)->right = OFF(right);
+    left                              = off;
+  }
+  free(spine);
+  return left;
+}
+
+static size_t putcmd(struct cmd *c) {
+  size_t off, a, b, d, i;
+
+  if (!c)
+    return 0;
+
+  switch (c->type) {
+  case CEXEC: {
+    struct cexec *ce = (struct cexec *)c;
+
+    a = putargs(ce->args);
+    b = 0;
+    if (ce->argv) {
+      /* the literal argv shares the strings of the args */
+      b = oalloc(sizeof(char *) * (ce->argc + 1));
+      for (i = 0, d = a; d; d = (uintptr_t)ONODE(struct arg, d)->next)
+        ((char **)(obuf + b))[i++] = ONODE(struct arg, d)->text;
+    }
+    off = oalloc(sizeof(*ce));
+    ONODE(struct cexec, off)->type = CEXEC;
+    ONODE(struct cexec, off)->argc = ce->argc;
+    ONODE(struct cexec, off)->argv = OFF(b);
+    ONODE(struct cexec, off)->args = OFF(a);
+    return off;
+  }
+
+  case CPIPE:
+  case CAND:
+  case COR:
+  case CLIST:
+  case CBGND:
+    return putlist((struct cbinary *)c);
+
+  case CBANG:
+  case CSUB:
+  case CBRC: {
+    struct cunary *cu = (struct cunary *)c;
+
+    a   = putcmd(cu->cmd);
+    off = oalloc(sizeof(*cu));
+    ONODE(struct cunary, off)->type = cu->type;
+    ONODE(struct cunary, off)->cmd  = OFF(a);
+    return off;
+  }
+
+  case CREDIR: {
+    struct credir *cr = (struct credir *)c;
+    size_t fnames[cr->nredir];
+    int i;
+
+    a = putcmd(cr->cmd);
+    for (i = 0; i < cr->nredir; i++)
+      fnames[i] = putargs(cr->redir[i].fname);
+    off = oalloc(sizeof(*cr) + cr->nredir * sizeof(*cr->redir));
+    ONODE(struct credir, off)->type   = CREDIR;
+    ONODE(struct credir, off)->nredir = cr->nredir;
+    ONODE(struct credir, off)->cmd    = OFF(a);
+    for (i = 0; i < cr->nredir; i++) {
+      ONODE(struct credir, off)->redir[i]       = cr->redir[i];
+      ONODE(struct credir, off)->redir[i].fname = OFF(fnames[i]);
+    }
+    return off;
+  }
+
+  case CSEQ: {
+    struct cseq *cs = (struct cseq *)c;
+    size_t *cmds    = xmalloc(cs->n * sizeof(*cmds));
+    int i;
+
+    for (i = 0; i < cs->n; i++)
+      cmds[i] = putcmd(cs->cmd[i]);
+    off = oalloc(sizeof(*cs) + cs->n * sizeof(*cs->cmd));
+    ONODE(struct cseq, off)->type = CSEQ;
+    ONODE(struct cseq, off)->n    = cs->n;
+    for (i = 0; i < cs->n; i++)
+      ONODE(struct cseq, off)->cmd[i] = OFF(cmds[i]);
+    free(cmds);
+    return off;
+  }
+
+  case CWHILE:
+  case CUNTIL: {
+    struct cloop *cl = (struct cloop *)c;
+
+    a   = putcmd(cl->cond);
+    b   = putcmd(cl->body);
+    off = oalloc(sizeof(*cl));
+    ONODE(struct cloop, off)->type = cl->type;
+    ONODE(struct cloop, off)->cond = OFF(a);
+    ONODE(struct cloop, off)->body = OFF(b);
+    return off;
+  }
+
+  case CIF: {
+    struct cif *ci = (struct cif *)c;
+
+    a   = putcmd(ci->cond);
+    b   = putcmd(ci->ifpart);
+    d   = putcmd(ci->elsepart);
+    off = oalloc(sizeof(*ci));
+    ONODE(struct cif, off)->type     = CIF;
+    ONODE(struct cif, off)->cond     = OFF(a);
+    ONODE(struct cif, off)->ifpart   = OFF(b);
+    ONODE(struct cif, off)->elsepart = OFF(d);
+    return off;
+  }
+
+  case CFOR: {
+    struct cfor *cf = (struct cfor *)c;
+
+    a   = putstr(cf->var);
+    b   = putargs(cf->list);
+    d   = putcmd(cf->body);
+    off = oalloc(sizeof(*cf));
+    ONODE(struct cfor, off)->type = CFOR;
+    ONODE(struct cfor, off)->var  = OFF(a);
+    ONODE(struct cfor, off)->list = OFF(b);
+    ONODE(struct cfor, off)->body = OFF(d);
+    return off;
+  }
+
+  case CCASE: {
+    struct ccase *cc = (struct ccase *)c;
+
+    a   = putargs(cc->expr);
+    b   = putcases(cc->list);
+    off = oalloc(sizeof(*cc));
+    ONODE(struct ccase, off)->type = CCASE;
+    ONODE(struct ccase, off)->expr = OFF(a);
+    ONODE(struct ccase, off)->list = OFF(b);
+    return off;
+  }
+
+  case CFUNC: {
+    struct cfunc *cfn = (struct cfunc *)c;
+
+    a   = putstr(cfn->name);
+    b   = putcmd(cfn->body);
+    off = oalloc(sizeof(*cfn));
+    ONODE(struct cfunc, off)->type = CFUNC;
+    ONODE(struct cfunc, off)->name = OFF(a);
+    ONODE(struct cfunc, off)->body = OFF(b);
+    return off;
+  }
+
+  case CARITH: {
+    struct carith *ca = (struct carith *)c;
+
+    a   = putargs(ca->expr);
+    off = oalloc(ca->size);
+    memcpy(obuf + off, ca, ca->size);
+    ONODE(struct carith, off)->expr = OFF(a);
+    return off;
+  }
+
+  default:
+    die("unknown command type: %d\n", c->type);
+  }
+}
+
+static int writeimage(const char *fname, const char *tmp) {
+  int fd;
+  size_t n;
+  ssize_t nw;
+
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    perrorf("%s:", tmp);
+    return 1;
+  }
+  for (n = 0; n < olen; n += nw) {
+    if ((nw = write(fd, obuf + n, olen - n)) < 0) {
+      if (errno == EINTR) {
+        nw = 0;
+        continue;
+      }
+      perrorf("%s:", tmp);
+      close(fd);
+      unlink(tmp);
+      return 1;
+    }
+  }
+  close(fd);
+  if (rename(tmp, fname) < 0) {
+    perrorf("%s:", fname);
+    unlink(tmp);
+    return 1;
+  }
+  return 0;
+}
+
+static int compile_script(const char *fname) {
+  struct stat st;
+  struct stackmark mark;
+  struct cmd *cmd;
+  struct compiled *tab;
+  struct shchdr *hdr;
+  size_t hdroff, taboff;
+  long *lines = NULL;
+  size_t *cmds = NULL;
+  size_t ncmds = 0, nalloc = 0, i;
+  char *shc, *tmp;
+  int status;
+
+  setinputfile(fname, INPUT_PUSH_FILE);
+  if (fstat(parsefile->fd, &st) < 0) {
+    perrorf("%s:", fname);
+    popfile();
+    return 1;
+  }
+
+  olen   = 0;
+  hdroff = oalloc(sizeof(struct shchdr));
+
+  pushstackmark(&mark);
+  while ((cmd = parseline())) {
+    if (ncmds == nalloc) {
+      nalloc = nalloc ? nalloc * 2 : 64;
+      cmds   = xrealloc(cmds, nalloc * sizeof(*cmds));
+      lines  = xrealloc(lines, nalloc * sizeof(*lines));
+    }
+    lines[ncmds]  = plineno;
+    cmds[ncmds++] = putcmd(cmd);
+    popstackmark(&mark);
+  }
+  popfile();
+
+  taboff = oalloc(ncmds * sizeof(struct compiled));
+  tab    = ONODE(struct compiled, taboff);
+  for (i = 0; i < ncmds; i++) {
+    tab[i].cmd    = OFF(cmds[i]);
+    tab[i].lineno = lines[i];
+  }
+  free(cmds);
+  free(lines);
+
+  hdr = ONODE(struct shchdr, hdroff);
+  memcpy(hdr->magic, SHCMAGIC, sizeof(hdr->magic));
+  hdr->bom        = SHCBOM;
+  hdr->ptrsize    = sizeof(void *);
+  hdr->size       = olen;
+  hdr->srcsize    = st.st_size;
+  hdr->srcmtime   = st.st_mtim.tv_sec;
+  hdr->srcmtimens = st.st_mtim.tv_nsec;
+  hdr->cmdtab     = taboff;
+  hdr->ncmds      = ncmds;
+
+  shc = stalloc(strlen(fname) + sizeof(SHCSUFFIX) + 4);
+  tmp = stalloc(strlen(fname) + sizeof(SHCSUFFIX) + 4);
+  sprintf(shc, "%s" SHCSUFFIX, fname);
+  sprintf(tmp, "%s" SHCSUFFIX ".tmp", fname);
+  status = writeimage(shc, tmp);
+  stfree(shc);
+  return status;
+}
+
+/* sh --compile script... */
+int compile_scripts(char **argv) {
+  int status = 0;
+
+  if (!*argv)
+    raiseerr("--compile requires an argument");
+  for (; *argv; argv++)
+    status |= compile_script(*argv);
+  free(obuf);
+  return status;
+}
+
+/*
+ * loading
+ */
+
+static char *ibase;
+
+/*
+ * Turn the offset stored in *pp into a pointer, after checking that it
+ * leaves room for `size` bytes below `limit`. Offset 0 stands for NULL.
+ */
+static int reloc(void **pp, size_t size, size_t limit) {
+  uintptr_t off = (uintptr_t)*pp;
+
+  if (off == 0)
+    return 0;
+  if (off % (ALIGNMENT + 1) || off < sizeof(struct shchdr) || off > limit ||
+      limit - off < size)
+    return -1;
+  *pp = ibase + off;
+  return 0;
+}
+
+static int relocstr(char **pp, size_t limit) {
+  if (reloc((void **)pp, 1, limit) < 0)
+    return -1;
+  if (*pp && !memchr(*pp, '\0', ibase + limit - *pp))
+    return -1;
+  return 0;
+}
+
+#define RELOC(field, type, limit) reloc((void **)&(field), sizeof(type), limit)
+#define LIMIT(p)                  ((char *)(p) - ibase)
+
+static int reloccmd(struct cmd **, size_t);
+
+static int relocargs(struct arg **app, size_t limit) {
+  struct arg *ap;
+
+  for (; RELOC(*app, struct arg, limit) == 0; app = &ap->next) {
+    if (!(ap = *app))
+      return 0;
+    limit = LIMIT(ap);
+    if (relocstr(&ap->text, limit) < 0 ||
+        reloccmd((struct cmd **)&ap->subst, limit) < 0)
+      return -1;
+  }
+  return -1;
+}
+
+static int reloccases(struct cases **cpp, size_t limit) {
+  struct cases *cp;
+
+  for (; RELOC(*cpp, struct cases, limit) == 0; cpp = &cp->next) {
+    if (!(cp = *cpp))
+      return 0;
+    limit = LIMIT(cp);
+    if (relocargs(&cp->patterns, limit) < 0 || reloccmd(&cp->cmd, limit) < 0)
+      return -1;
+  }
+  return -1;
+}
+
+static int relocargv(struct cexec *ce, size_t limit) {
+  int i;
+
+  if (!ce->argv)
+    return 0;
+  if (ce->argc <= 0 || (size_t)ce->argc >= limit / sizeof(char *) ||
+      RELOC(ce->argv, char *[ce->argc + 1], limit) < 0)
+    return -1;
+  limit = LIMIT(ce->argv);
+  for (i = 0; i < ce->argc; i++)
+    if (relocstr(&ce->argv[i], limit) < 0 || !ce->argv[i])
+      return -1;
+  return ce->argv[i] ? -1 : 0;
+}
+
+static int reloccmd(struct cmd **cpp, size_t limit) {
+  struct cmd *c;
+
+  for (;;) {
+    /* the smallest node, the real size is checked below */
+    if (RELOC(*cpp, struct cunary, limit) < 0)
+      return -1;
+    if (!(c = *cpp))
+      return 0;
+
+#define NODE(type)                                                             \
+  if (LIMIT(c) + sizeof(type) > limit)                                         \
+    return -1;                                                                 \
+  limit = LIMIT(c);
+
+    switch (c->type) {
+    case CEXEC: {
+      struct cexec *ce = (struct cexec *)c;
+      NODE(struct cexec);
+      if (relocargs(&ce->args, limit) < 0)
+        return -1;
+      return relocargv(ce, limit);
+    }
+
+    case CPIPE:
+    case CAND:
+    case COR:
+    case CLIST:
+    case CBGND: {
+      struct cbinary *cb = (struct cbinary *)c;
+      NODE(struct cbinary);
+      if (reloccmd(&cb->right, limit) < 0)
+        return -1;
+      cpp = &cb->left;
+      continue;
+    }
+
+    case CBANG:
+    case CSUB:
+    case CBRC: {
+      struct cunary *cu = (struct cunary *)c;
+      NODE(struct cunary);
+      cpp = &cu->cmd;
+      continue;
+    }
+
+    case CREDIR: {
+      struct credir *cr = (struct credir *)c;
+      size_t end        = limit;
+      int i;
+
+      NODE(struct credir);
+      if (cr->nredir <= 0 ||
+          (size_t)cr->nredir > (end - limit - sizeof(*cr)) / sizeof(*cr->redir))
+        return -1;
+      for (i = 0; i < cr->nredir; i++)
+        if (relocargs(&cr->redir[i].fname, limit) < 0)
+          return -1;
+      cpp = &cr->cmd;
+      continue;
+    }
+
+    case CSEQ: {
+      struct cseq *cs = (struct cseq *)c;
+      size_t end      = limit;
+      int i;
+
+      NODE(struct cseq);
+      if (cs->n <= 0 ||
+          (size_t)cs->n > (end - limit - sizeof(*cs)) / sizeof(*cs->cmd))
+        return -1;
+      for (i = 0; i < cs->n - 1; i++)
+        if (reloccmd(&cs->cmd[i], limit) < 0)
+          return -1;
+      cpp = &cs->cmd[i];
+      continue;
+    }
+
+    case CWHILE:
+    case CUNTIL: {
+      struct cloop *cl = (struct cloop *)c;
+      NODE(struct cloop);
+      if (reloccmd(&cl->cond, limit) < 0)
+        return -1;
+      cpp = &cl->body;
+      continue;
+    }
+
+    case CIF: {
+      struct cif *ci = (struct cif *)c;
+      NODE(struct cif);
+      if (reloccmd(&ci->cond, limit) < 0 || reloccmd(&ci->ifpart, limit) < 0)
+        return -1;
+      cpp = &ci->elsepart;
+      continue;
+    }
+
+    case CFOR: {
+      struct cfor *cf = (struct cfor *)c;
+      NODE(struct cfor);
+      if (relocstr(&cf->var, limit) < 0 || relocargs(&cf->list, limit) < 0)
+        return -1;
+      cpp = &cf->body;
+      continue;
+    }
+
+    case CCASE: {
+      struct ccase *cc = (struct ccase *)c;
+      NODE(struct ccase);
+      if (relocargs(&cc->expr, limit) < 0)
+        return -1;
+      return reloccases(&cc->list, limit);
+    }
+
+    case CFUNC: {
+      struct cfunc *cfn = (struct cfunc *)c;
+      NODE(struct cfunc);
+      if (relocstr(&cfn->name, limit) < 0)
+        return -1;
+      cpp = &cfn->body;
+      continue;
+    }
+
+    case CARITH: {
+      struct carith *ca = (struct carith *)c;
+      size_t end        = limit;
+
+      NODE(struct carith);
+      if (ca->size < 0 || (size_t)ca->size > end - limit ||
+          relocargs(&ca->expr, limit) < 0)
+        return -1;
+      if (ca->expr)
+        return ca->nnodes == 0 && ca->size == sizeof(*ca) ? 0 : -1;
+      return arithcheck(ca);
+    }
+
+    default:
+      return -1;
+    }
+#undef NODE
+  }
+}
+
+/*
+ * Attach the precompiled image of the script `fname`, which is the current
+ * input file, if there is an up to date one. Returns 0 on success.
+ *
+ * The source size and mtime recorded in the image can be read off the
+ * script by anyone, so they only show that the image is current. It is
+ * only run if it belongs to the owner of the script or to us and nobody
+ * else can write it; else anyone able to create files next to the script
+ * could run their code in its place.
+ */
+int loadcompiled(const char *fname) {
+  struct stat src, st;
+  struct shchdr *hdr;
+  struct compiled *tab;
+  char *shc;
+  size_t i;
+  int fd;
+
+  if (fstat(parsefile->fd, &src) < 0)
+    return -1;
+
+  shc = stalloc(strlen(fname) + sizeof(SHCSUFFIX));
+  sprintf(shc, "%s" SHCSUFFIX, fname);
+  fd = open(shc, O_RDONLY | O_CLOEXEC);
+  stfree(shc);
+  if (fd < 0)
+    return -1;
+
+  ibase = MAP_FAILED;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+      (st.st_uid != src.st_uid && st.st_uid != geteuid()) ||
+      st.st_mode & (S_IWGRP | S_IWOTH) || (size_t)st.st_size < sizeof(*hdr) ||
+      (ibase = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                    0)) == MAP_FAILED)
+    goto bad;
+
+  hdr = (struct shchdr *)ibase;
+  if (memcmp(hdr->magic, SHCMAGIC, sizeof(hdr->magic)) ||
+      hdr->bom != SHCBOM || hdr->ptrsize != sizeof(void *) ||
+      hdr->size != (uint64_t)st.st_size ||
+      hdr->srcsize != (uint64_t)src.st_size ||
+      hdr->srcmtime != src.st_mtim.tv_sec ||
+      hdr->srcmtimens != src.st_mtim.tv_nsec ||
+      hdr->cmdtab % (ALIGNMENT + 1) || hdr->cmdtab > hdr->size ||
+      hdr->ncmds > (hdr->size - hdr->cmdtab) / sizeof(*tab))
+    goto bad;
+
+  tab = (struct compiled *)(ibase + hdr->cmdtab);
+  for (i = 0; i < hdr->ncmds; i++)
+    if (reloccmd(&tab[i].cmd, hdr->cmdtab) < 0 || !tab[i].cmd)
+      goto bad;
+
+  close(fd);
+  parsefile->cmds  = tab;
+  parsefile->ncmds = hdr->ncmds;
+  return 0;
+
+bad:
+  if (ibase != MAP_FAILED)
+    munmap(ibase, st.st_size);
+  close(fd);
+  return -1;
+}
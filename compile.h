@@ -0,0 +1,18 @@
+/** \file compile.h
+ */
+
+#ifndef COMPILE_H
+#define COMPILE_H
+
+#include "cmd.h"
+
+/* a top-level command of a precompiled script */
+struct compiled {
+  struct cmd *cmd;
+  long lineno;
+};
+
+int compile_scripts(char **);
+int loadcompiled(const char *);
+
+#endif
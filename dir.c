@@ -0,0 +1,132 @@
+/*
+ * \file dir.c
+ *
+ * Directory listings. They are kept in a small cache keyed by path and
+ * checked against the directory's identity and mtime, so a directory that
+ * is searched again and again is only read when it changes.
+ */
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "dir.h"
+#include "mem.h"
+
+#define NDIRCACHE 8
+
+static struct dirlist *dircache[NDIRCACHE];
+static int nextslot;
+
+static int dentcmp(const void *a, const void *b) {
+  return strcmp(((const struct dent *)a)->name, ((const struct dent *)b)->name);
+}
+
+static struct dirlist *readlist(const char *path, struct stat *st) {
+  struct dirlist *dl;
+  struct dirent *de;
+  DIR *dp;
+  char *p, *names;
+  size_t size, plen = strlen(path) + 1;
+  int i, n = 0;
+
+  if (!(dp = opendir(path)))
+    return NULL;
+
+  /* each entry goes on the stack as its type and its name */
+  STARTSTACKSTR(p);
+  while ((de = readdir(dp))) {
+    if (de->d_name[0] == '.' &&
+        (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2])))
+      continue;
+    STPUTC(de->d_type, p);
+    p = stnputs(de->d_name, strlen(de->d_name) + 1, p);
+    n++;
+  }
+  closedir(dp);
+
+  size = p - (char *)stackblock();
+  dl   = xmalloc(sizeof(*dl) + n * sizeof(*dl->ent) + size + plen);
+  dl->path = (char *)(dl->ent + n) + size;
+  memcpy(dl->path, path, plen);
+  dl->dev     = st->st_dev;
+  dl->ino     = st->st_ino;
+  dl->mtime   = st->st_mtim;
+  dl->trusted = 0;
+  dl->cached  = 0;
+  dl->busy    = 0;
+  dl->n       = n;
+
+  names = memcpy(dl->ent + n, stackblock(), size);
+  for (i = 0; i < n; i++) {
+    dl->ent[i].type = (unsigned char)*names++;
+    dl->ent[i].name = names;
+    dl->ent[i].len  = strlen(names);
+    names += dl->ent[i].len + 1;
+  }
+  qsort(dl->ent, n, sizeof(*dl->ent), dentcmp);
+  return dl;
+}
+
+/*
+ * The listing of the directory path, from the cache if it has not changed
+ * since, or NULL if it can't be read. It is handed back with freelist(),
+ * and may be replaced by the next call unless it is marked busy. A listing
+ * is only trusted if the directory had not changed for a second when it was
+ * read: a change in the same tick of the file system's clock would leave
+ * the mtime as it was.
+ */
+struct dirlist *dirlist(const char *path) {
+  struct dirlist *dl;
+  struct timespec now;
+  struct stat st;
+  int i, slot = -1;
+
+  if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+    return NULL;
+
+  for (i = 0; i < NDIRCACHE; i++) {
+    if (!(dl = dircache[i]) || strcmp(dl->path, path))
+      continue;
+    if (dl->trusted && dl->dev == st.st_dev && dl->ino == st.st_ino &&
+        dl->mtime.tv_sec == st.st_mtim.tv_sec &&
+        dl->mtime.tv_nsec == st.st_mtim.tv_nsec)
+      return dl;
+    if (!dl->busy)
+      slot = i;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (!(dl = readlist(path, &st)))
+    return NULL;
+  dl->trusted = st.st_mtim.tv_sec < now.tv_sec - 1;
+
+  /* replace the old listing of path, else the next one not being walked */
+  for (i = 0; slot < 0 && i < NDIRCACHE; i++) {
+    nextslot = (nextslot + 1) % NDIRCACHE;
+    if (!dircache[nextslot] || !dircache[nextslot]->busy)
+      slot = nextslot;
+  }
+  if (slot >= 0) {
+    free(dircache[slot]);
+    dircache[slot] = dl;
+    dl->cached     = 1;
+  }
+  return dl;
+}
+
+/* done with a listing, which is freed unless the cache holds it */
+void freelist(struct dirlist *dl) {
+  if (!dl->cached)
+    free(dl);
+}
+
+static int findcmp(const void *key, const void *ent) {
+  return strcmp(key, ((const struct dent *)ent)->name);
+}
+
+/* the entry of dl named name, or NULL */
+struct dent *dirfind(struct dirlist *dl, const char *name) {
+  return bsearch(name, dl->ent, dl->n, sizeof(*dl->ent), findcmp);
+}
@@ -0,0 +1,34 @@
+/*
+ * \file dir.h
+ */
+
+#ifndef DIR_H
+#define DIR_H
+
+#include <sys/types.h>
+#include <time.h>
+
+struct dent {
+  const char *name;
+  int len;
+  int type; /* d_type, DT_UNKNOWN if the file system does not say */
+};
+
+/* the entries of a directory but . and .., sorted, followed by the names */
+struct dirlist {
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  int trusted; /* last changed well before it was read */
+  int cached;
+  int busy; /* being walked, so not to be evicted */
+  int n;
+  struct dent ent[];
+};
+
+struct dirlist *dirlist(const char *);
+void freelist(struct dirlist *);
+struct dent *dirfind(struct dirlist *, const char *);
+
+#endif
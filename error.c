@@ -58,8 +58,9 @@ void vraiseerr(const char *fmt, va_list ap) {
   exraise(EXERR);
 }
 
-void vpreraiseerr(const char *pre, const char *fmt, va_list ap) {
-  vpreperrorf(pre, fmt, ap);
+void vpreraiseerr(const char *name, const char *pre, const char *fmt,
+                  va_list ap) {
+  vpreperrorf(name, pre, fmt, ap);
   exitstatus = 2;
   exraise(EXERR);
 }
@@ -48,6 +48,6 @@ void onint(void) __attribute__((noreturn));
 void raiseexc(int, const char *, ...) __attribute__((noreturn));
 void raiseerr(const char *fmt, ...) __attribute__((noreturn));
 void vraiseerr(const char *fmt, va_list ap) __attribute__((noreturn));
-void vpreraiseerr(const char *pre, const char *fmt, va_list ap) __attribute__((noreturn));
+void vpreraiseerr(const char *name, const char *pre, const char *fmt, va_list ap) __attribute__((noreturn));
 
 #endif
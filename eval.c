@@ -22,11 +22,14 @@
 #include "mem.h"
 #include "options.h"
 #include "output.h"
+#include "parser.h"
 #include "redir.h"
 #include "sh.h"
+#include "source.h"
 #include "str.h"
 #include "trap.h"
 #include "var.h"
+#include "vm.h"
 
 int exitstatus;
 int forked;
@@ -35,19 +38,23 @@ char *commandname = NULL;
 static struct jmploc *funcret = NULL;
 
 static int evalpipe(struct cmd *);
+static int evalredir(struct credir *);
+static int runcmd(struct funcentry *, struct builtin *, int, char **,
+                  struct credir *);
+#ifdef NOVM
 static int evalloop(struct cmd *);
 static int evalfor(struct cmd *);
+#endif
 static int evalcase(struct cmd *);
-static int evalfunc(struct cfunc *, int, char **);
+static int evalfunc(struct funcentry *, int, char **);
 static int evalbltin(builtin_func f, int, char **);
 static int evalcond(struct cmd *);
+static int evalandor(struct cmd *);
+static int evalcached(struct evalent *, char *);
 
 struct cfunc *last;
 
-static struct looploc {
-  struct looploc *next;
-  jmp_buf loc;
-} *loops;
+struct looploc *loops;
 
 int eval(struct cmd *c) {
   pid_t pid;
@@ -55,24 +62,19 @@ int eval(struct cmd *c) {
   struct cexec *ce;
   struct cif *ci;
   struct cbinary *cb;
-  struct credir *cr;
   struct cunary *cu;
   struct cfunc *cf;
+  struct cseq *cs;
+  int i;
 
   switch (c->type) {
   case CEXEC:
     ce = (struct cexec *)c;
-    exitstatus = evalcmd(ce);
+    exitstatus = evalcmd(ce, NULL);
     break;
 
   case CREDIR:
-    cr = (struct credir *)c;
-    if (pushredirect(cr) >= 0) {
-      exitstatus = eval(cr->cmd);
-      popredirect();
-    } else {
-      exitstatus = 2;
-    }
+    exitstatus = evalredir((struct credir *)c);
     break;
 
   case CPIPE:
@@ -86,10 +88,7 @@ int eval(struct cmd *c) {
 
   case CAND:
   case COR:
-    cb = (struct cbinary *)c;
-
-    if ((exitstatus = eval(cb->left)) ^ (cb->type == CAND))
-      exitstatus = eval(cb->right);
+    exitstatus = evalandor(c);
     break;
 
   case CBGND:
@@ -111,6 +110,13 @@ int eval(struct cmd *c) {
       exitstatus = eval(cb->right);
     break;
 
+  case CSEQ:
+    cs = (struct cseq *)c;
+
+    for (i = 0; i < cs->n; i++)
+      exitstatus = eval(cs->cmd[i]);
+    break;
+
   case CIF:
     ci = (struct cif *)c;
 
@@ -123,11 +129,19 @@ int eval(struct cmd *c) {
 
   case CWHILE:
   case CUNTIL:
+#ifndef NOVM
+    exitstatus = runcode(compilecode(c, 0));
+#else
     exitstatus = evalloop(c);
+#endif
     break;
 
   case CFOR:
+#ifndef NOVM
+    exitstatus = runcode(compilecode(c, 0));
+#else
     exitstatus = evalfor(c);
+#endif
     break;
 
   case CBRC:
@@ -160,6 +174,36 @@ int eval(struct cmd *c) {
   return exitstatus;
 }
 
+/*
+ * Applies the redirections of a command. A simple command takes them along
+ * so that a program gets them in its child, and a subshell takes them after
+ * it forks; neither needs the old descriptors saved and restored.
+ */
+static int evalredir(struct credir *cr) {
+  struct cunary *cu;
+  pid_t pid;
+  int status;
+
+  switch (cr->cmd->type) {
+  case CEXEC:
+    return evalcmd((struct cexec *)cr->cmd, cr);
+  case CSUB:
+    cu = (struct cunary *)cr->cmd;
+    if ((pid = dfork()) == 0) {
+      if (pushredirect(cr, REDIR_NOSAVE) < 0)
+        _exit(2);
+      _exit(eval(cu->cmd));
+    }
+    return waitsh(pid);
+  }
+
+  if (pushredirect(cr, 0) < 0)
+    return 2;
+  status = eval(cr->cmd);
+  popredirect();
+  return status;
+}
+
 /*
  * runs the command
  *
@@ -168,7 +212,7 @@ int eval(struct cmd *c) {
  *
  * returns the exitstatus
  */
-int evalcmd(struct cexec *cmd) {
+int evalcmd(struct cexec *cmd, struct credir *redir) {
   struct funcentry *fp = NULL;
   struct builtin *bilt = NULL;
 
@@ -179,12 +223,28 @@ int evalcmd(struct cexec *cmd) {
   int vlocal = 0;        //
   int pseudovarflag = 0; // sometimes we parse regular cmd args as variables
                          // (i.e. `local/export`)
+  int nocopy = EXP_NOCOPY;
+  int status;
+
+  if (cmd->argv)
+    return evalargv(cmd, redir);
+
+  /* with no command word the redirections come before the assignments */
+  for (ap = cmd->args; ap && isassignment(ap->text); ap = ap->next)
+    ;
+  if (redir && !ap) {
+    if (pushredirect(redir, 0) < 0)
+      return 2;
+    status = evalcmd(cmd, NULL);
+    popredirect();
+    return status;
+  }
 
   for (ap = cmd->args; ap; ap = ap->next) {
     struct arg *ep;
     int expflags = (!cmdarg || (pseudovarflag && isassignment(ap->text)))
-                       ? EXP_NOSPLIT
-                       : EXP_FULL;
+                       ? EXP_NOSPLIT | nocopy
+                       : EXP_FULL | nocopy;
 
     *exp = ep = expandarg(ap, &last, expflags);
     if (!ep)
@@ -198,6 +258,12 @@ int evalcmd(struct cexec *cmd) {
       } else if ((bilt = get_builtin(cmdarg->text))) {
         vlocal = (bilt->flags & BUILTIN_SPECIAL) ^ BUILTIN_SPECIAL;
         pseudovarflag = bilt->flags & BUILTIN_ASSIGN;
+        if (bilt->flags & BUILTIN_EVAL) {
+          /* set or shift in the code it runs could free our args */
+          nocopy = 0;
+          for (struct arg *cp = cmdarg; cp; cp = cp->next)
+            cp->text = sstrdup(cp->text);
+        }
       }
     }
     exp = &last->next;
@@ -217,9 +283,6 @@ int evalcmd(struct cexec *cmd) {
     *av = ap->text;
   *av = NULL;
 
-  cmd->argc = argc;
-  cmd->argv = argv;
-
   if (xflag) {
     dprintf(preverrfd, "%s", ps4val);
     for (ap = expargs; ap; ap = ap->next) {
@@ -240,18 +303,105 @@ int evalcmd(struct cexec *cmd) {
     }
   }
 
-  if (!cmdarg)
+  if (!cmdarg) {
+    /* still open the files */
+    if (redir && pushredirect(redir, 0) < 0)
+      return 2;
+    if (redir)
+      popredirect();
     return 0;
+  }
+
+  status = runcmd(fp, bilt, argc, argv, redir);
+
+  unwindlocalvars(prevlf);
+  return status;
+}
+
+/* names whose FPATH file is being sourced */
+struct autoloading {
+  struct autoloading *next;
+  const char *name;
+};
+
+static struct autoloading *autoloading;
+
+/*
+ * Source the file named after a command from FPATH, and return the
+ * function it defines. A file can't autoload the function it defines.
+ */
+static struct funcentry *autoload(char *name) {
+  struct autoloading here, *ap;
+  struct looploc *saveloops = loops;
+  char *argv[3];
+
+  for (ap = autoloading; ap; ap = ap->next)
+    if (strcmp(ap->name, name) == 0)
+      return NULL;
+  if (!(argv[1] = fpathfind(name)))
+    return NULL;
+  argv[0] = ".";
+  argv[2] = NULL;
+
+  /* evalbltin() catches errors, and break can't leave the file */
+  here.next   = autoloading;
+  here.name   = name;
+  autoloading = &here;
+  loops       = NULL;
+  evalbltin(source_builtin, 2, argv);
+  loops       = saveloops;
+  autoloading = here.next;
+
+  return lookupfunc(name, 0);
+}
 
+/*
+ * runs a function, builtin or program with the redirections of its
+ * command, if any
+ */
+static int runcmd(struct funcentry *fp, struct builtin *bilt, int argc,
+                  char **argv, struct credir *redir) {
   int status;
-  if (fp) {
-    status = evalfunc(fp->func, argc, argv);
-  } else if (bilt) {
+
+  if (!fp && !bilt && !(fp = autoload(argv[0])))
+    return runprog(argv, redir);
+
+  if (redir && pushredirect(redir, 0) < 0)
+    return 2;
+  if (fp)
+    status = evalfunc(fp, argc, argv);
+  else
     status = evalbltin(bilt->func, argc, argv);
-  } else {
-    status = runprog(argv);
+  if (redir)
+    popredirect();
+  return status;
+}
+
+/*
+ * runs a simple command whose words are all literal, from the argv the
+ * parser built for it
+ */
+int evalargv(struct cexec *cmd, struct credir *redir) {
+  struct funcentry *fp;
+  struct builtin *bilt = NULL;
+  struct localframe *prevlf;
+  int status, vlocal = 1;
+  char **argv, **av;
+
+  argv = stalloc(sizeof(*argv) * (cmd->argc + 1));
+  memcpy(argv, cmd->argv, sizeof(*argv) * (cmd->argc + 1));
+
+  if (!(fp = lookupfunc(argv[0], 0)) && (bilt = get_builtin(argv[0])))
+    vlocal = (bilt->flags & BUILTIN_SPECIAL) ^ BUILTIN_SPECIAL;
+
+  if (xflag) {
+    dprintf(preverrfd, "%s", ps4val);
+    for (av = argv; *av; av++)
+      dprintf(preverrfd, av[1] ? "%s " : "%s\n", *av);
   }
 
+  prevlf = pushlocalframe(vlocal);
+  status = runcmd(fp, bilt, cmd->argc, argv, redir);
   unwindlocalvars(prevlf);
   return status;
 }
@@ -259,12 +409,21 @@ int evalcmd(struct cexec *cmd) {
 static int evalbltin(builtin_func f, int argc, char **argv) {
   char *volatile savecmdname;
   struct jmploc *volatile savehandler;
+  struct parsefile *volatile savepf;
+  struct redirtab *volatile saveredir;
+  volatile int savepins;
   struct jmploc here;
   int i, status;
 
   savecmdname = commandname;
   savehandler = handler;
+  savepf      = parsefile;
+  saveredir   = redirlist;
+  savepins    = npins;
   if ((i = setjmp(here.loc))) {
+    unwindfiles(savepf);
+    unwindredir(saveredir);
+    unwindpins(savepins);
     status = exitstatus;
     goto done;
   }
@@ -277,11 +436,15 @@ done:
   return status;
 }
 
-static int evalfunc(struct cfunc *cf, int argc, char **argv) {
+static int evalfunc(struct funcentry *fp, int argc, char **argv) {
   int status;
+  struct cfunc *cf;
   struct stackmark mark;
   struct shparam saveparam = shparam;
 
+  loadfunc(fp);
+  cf = fp->func;
+
   shparam.mallocd = 0;
   shparam.np = argc - 1;
   shparam.p = argv + 1;
@@ -290,9 +453,21 @@ static int evalfunc(struct cfunc *cf, int argc, char **argv) {
   struct looploc *saveloops = loops;
   loops = NULL;
 
+  struct parsefile *savepf = parsefile;
+  struct redirtab *saveredir = redirlist;
+  struct jmploc *savehandler = handler;
+  char *savecmdname = commandname;
+  int savepins = npins;
+
   struct jmploc here;
   funcret = &here;
   if ((status = setjmp(here.loc))) {
+    /* return skips evalbltin() putting these back */
+    handler = savehandler;
+    commandname = savecmdname;
+    unwindfiles(savepf);
+    unwindredir(saveredir);
+    unwindpins(savepins);
     popstackmark(&mark);
     if (status < 0)
       status = 0;
@@ -301,7 +476,13 @@ static int evalfunc(struct cfunc *cf, int argc, char **argv) {
   pushstackmark(&mark);
 
   DEBUGF("running func %s", cf->name);
+#ifndef NOVM
+  if (!fp->code)
+    fp->code = compilecode(cf->body, 1);
+  status = runcode(fp->code);
+#else
   status = eval(cf->body);
+#endif
 out:
   freeparam(&shparam);
   shparam = saveparam;
@@ -342,28 +523,83 @@ int evalstring(char *s) {
   return status;
 }
 
+/*
+ * . [-o] file
+ *
+ * The top-level commands of a file that ran to completion are cached, and
+ * later runs of the unchanged file evaluate the cached trees without
+ * parsing. With -o a file that was already sourced is skipped. Function
+ * bodies in the file are only parsed when the function is first called.
+ */
 int source_builtin(int argc, char **argv) {
-  int status;
+  int i, status, once = 0;
+  struct srcfile *volatile sp;
+  struct cmd *cmd;
+  struct stackmark mark;
+
+  if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+    once = 1;
+    argv++;
+    argc--;
+  }
 
   if (argc < 2) {
     perrorf("%s: not enough arguments", argv[0]);
     return 1;
   }
 
+  sp = lookupsrc(argv[1]);
+  if (once && sp && (sp->flags & SRC_LOADED))
+    return 0;
+
   struct jmploc *saveret = funcret;
   struct looploc *saveloops = loops;
+  int savepins = npins;
+  volatile int pushed = 0;
 
   struct jmploc here;
   funcret = &here;
   if ((status = setjmp(here.loc))) {
+    popstackmark(&mark);
     if (status < 0)
       status = 0;
     goto out;
   }
-  setinputfile(argv[1], INPUT_PUSH_FILE);
-  status = repl();
+  pushstackmark(&mark);
+
+  if (sp && (sp->flags & SRC_CACHED)) {
+    pin(&sp->busy);
+    for (i = 0; i < sp->ncmds; i++) {
+      eval(sp->cmds[i]);
+      popstackmark(&mark);
+    }
+    status = exitstatus;
+    goto out;
+  }
+
+  setinputfile(argv[1], INPUT_PUSH_FILE | INPUT_LAZY);
+  pushed = 1;
+  /* being recorded further up, so just parse it */
+  if (sp && sp->busy)
+    sp = NULL;
+  if (sp) {
+    pin(&sp->busy);
+    clearsrc(sp);
+    sp->flags |= SRC_LOADED;
+  }
+
+  for (; (cmd = parseline()); popstackmark(&mark)) {
+    if (sp)
+      recordsrc(sp, cmd);
+    eval(cmd);
+  }
+  if (sp)
+    sp->flags |= SRC_CACHED;
+  status = exitstatus;
 out:
-  popfile();
+  unwindpins(savepins);
+  if (pushed)
+    popfile();
   funcret = saveret;
   loops = saveloops;
   return status;
@@ -372,7 +608,9 @@ out:
 int eval_builtin(int argc, char **argv) {
   int status;
   char *p, *concat, **ap;
+  struct evalent *ep;
   struct stackmark mark;
+  int savepins = npins;
 
   pushstackmark(&mark);
 
@@ -392,11 +630,50 @@ int eval_builtin(int argc, char **argv) {
     STACKSTRNUL(concat);
     p = ststrsave(concat);
   }
-  status = evalstring(p);
+  if ((ep = lookupeval(p))) {
+    status = evalcached(ep, p);
+    unwindpins(savepins);
+  } else {
+    status = evalstring(p);
+  }
   popstackmark(&mark);
   return status;
 }
 
+/*
+ * Runs an eval string from the eval cache, recording its commands as they
+ * are parsed the first time.
+ */
+static int evalcached(struct evalent *ep, char *s) {
+  int i;
+  struct cmd *cmd;
+  struct stackmark mark;
+
+  if (ep->flags & SRC_CACHED) {
+    pushstackmark(&mark);
+    for (i = 0; i < ep->ncmds; i++) {
+      eval(ep->cmds[i]);
+      popstackmark(&mark);
+    }
+    return exitstatus;
+  }
+
+  /* being recorded further up */
+  if (ep->busy > 1)
+    return evalstring(s);
+
+  cleareval(ep);
+  s = sstrdup(s);
+  setinputstring(s, INPUT_PUSH_FILE);
+  for (pushstackmark(&mark); (cmd = parseline()); popstackmark(&mark)) {
+    recordeval(ep, cmd);
+    eval(cmd);
+  }
+  popfile();
+  ep->flags |= SRC_CACHED;
+  return exitstatus;
+}
+
 static int evalpipe(struct cmd *c) {
   int pip[2], status;
   pid_t pl, pr;
@@ -446,16 +723,27 @@ static int poploop(int lvl, int type) {
   longjmp(jmppnt->loc, type);
 }
 
+#ifdef NOVM
 static int evalloop(struct cmd *c) {
   int mod, type;
   struct looploc here;
   struct cloop *cmd;
   struct stackmark mark;
+  struct parsefile *pf = parsefile;
+  struct redirtab *redir = redirlist;
+  struct jmploc *savehandler = handler;
+  char *savecmdname = commandname;
+  int savepins = npins;
 
   cmd = (struct cloop *)c;
   mod = cmd->type == CWHILE;
 
   if ((type = setjmp(here.loc))) {
+    handler = savehandler;
+    commandname = savecmdname;
+    unwindfiles(pf);
+    unwindredir(redir);
+    unwindpins(savepins);
     popstackmark(&mark);
     if (type == SKIPBREAK)
       goto brk;
@@ -465,7 +753,7 @@ static int evalloop(struct cmd *c) {
 
   pushstackmark(&mark);
 
-  while (evalcond(cmd->cond) ^ mod) {
+  while ((evalcond(cmd->cond) == 0) == mod) {
     exitstatus = eval(cmd->body);
     popstackmark(&mark);
   }
@@ -475,6 +763,7 @@ brk:
   popstackmark(&mark);
   return exitstatus;
 }
+#endif
 
 int break_builtin(int argc, char **argv) {
   int n = argc > 1 ? number(argv[1]) : 1;
@@ -486,12 +775,18 @@ int break_builtin(int argc, char **argv) {
   return poploop(n, type);
 }
 
+#ifdef NOVM
 static int evalfor(struct cmd *c) {
   int type;
   struct cfor *cmd;
   struct arg *lp, *explist;
   struct stackmark fmark, mark;
   struct looploc here;
+  struct parsefile *pf = parsefile;
+  struct redirtab *redir = redirlist;
+  struct jmploc *savehandler = handler;
+  char *savecmdname = commandname;
+  int savepins = npins;
 
   cmd = (struct cfor *)c;
   pushstackmark(&fmark);
@@ -507,11 +802,16 @@ static int evalfor(struct cmd *c) {
 
   for (lp = explist; lp; lp = lp->next) {
     if ((type = setjmp(here.loc))) {
+      handler = savehandler;
+      commandname = savecmdname;
+      unwindfiles(pf);
+      unwindredir(redir);
+      unwindpins(savepins);
       popstackmark(&mark);
       if (type == SKIPBREAK)
         break;
-      else
-        continue;
+      loops = &here;
+      continue;
     }
     setvar(cmd->var, lp->text, 0);
     exitstatus = eval(cmd->body);
@@ -522,6 +822,30 @@ static int evalfor(struct cmd *c) {
   popstackmark(&fmark);
   return exitstatus;
 }
+#endif
+
+/*
+ * && and || lists are left-deep, so walk the left spine instead of
+ * recursing down it, then run the right hand sides bottom up.
+ */
+static int evalandor(struct cmd *c) {
+  struct cbinary **spine;
+  struct cmd *p;
+  int i, n = 0;
+
+  for (p = c; p->type == CAND || p->type == COR;
+       p = ((struct cbinary *)p)->left)
+    n++;
+  spine = stalloc(n * sizeof(*spine));
+  for (i = n; i > 0; c = spine[i]->left)
+    spine[--i] = (struct cbinary *)c;
+
+  exitstatus = eval(c);
+  for (i = 0; i < n; i++)
+    if ((exitstatus == 0) == (spine[i]->type == CAND))
+      exitstatus = eval(spine[i]->right);
+  return exitstatus;
+}
 
 static int evalcase(struct cmd *c) {
   int status = 0;
@@ -538,7 +862,7 @@ static int evalcase(struct cmd *c) {
   int fallthrough = 0;
   for (cs = cc->list; cs; cs = cs->next) {
     for (p = cs->patterns; p; p = p->next) {
-      char *pattern = exparg(p);
+      char *pattern = exppattern(p);
       if (fallthrough || glob_match(res, pattern)) {
         if (cs->cmd)
           status = eval(cs->cmd);
@@ -559,7 +883,10 @@ out:
  * fork and die on failure
  */
 pid_t dfork() {
-  pid_t pid = fork();
+  pid_t pid;
+
+  syncstdin();
+  pid = fork();
   if (pid < 0)
     die("fork:");
   if (pid == 0) {
@@ -579,7 +906,7 @@ pid_t dfork() {
  * The parent waits until the child program is done.
  * Gets the return value by waitpid.
  */
-int runprog(char **argv) {
+int runprog(char **argv, struct credir *redir) {
   int status;
   pid_t pid;
   char **envp = environment();
@@ -587,6 +914,8 @@ int runprog(char **argv) {
   INTOFF;
   if ((pid = dfork()) == 0) {
     /* child */
+    if (redir && pushredirect(redir, REDIR_NOSAVE) < 0)
+      _exit(2);
     execvpe(argv[0], argv, envp);
     /* if error */
     sdie(127, "%s:", argv[0]);
@@ -5,16 +5,25 @@
 #define EVAL_H
 
 #include "cmd.h"
+#include <setjmp.h>
 #include <sys/types.h>
 
+/* innermost running loop, for break and continue */
+struct looploc {
+  struct looploc *next;
+  jmp_buf loc;
+};
+
 extern int exitstatus;
 extern int forked;
 extern char *commandname;
+extern struct looploc *loops;
 
 int eval(struct cmd *);
-int evalcmd(struct cexec *);
+int evalcmd(struct cexec *, struct credir *);
+int evalargv(struct cexec *, struct credir *);
 int evalstring(char *s);
-int runprog(char **argv);
+int runprog(char **argv, struct credir *);
 pid_t dfork(void);
 int waitsh(int);
 
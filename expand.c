@@ -8,14 +8,18 @@
  */
 
 #include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "arith.h"
 #include "cmd.h"
 #include "error.h"
 #include "eval.h"
 #include "expand.h"
+#include "glob.h"
 #include "lexer.h"
 #include "mem.h"
 #include "options.h"
@@ -29,13 +33,58 @@ static char *expdest;
 static int quote;
 static int len;
 static int split;
+static int heredoc;
+static int oneword;   /* $@ joins like $*, no nul ever ends a field */
+static int splitlit;  /* unquoted text splits too, as in ${x-word} */
+static int pattern;   /* quoted text is escaped for patcompile() */
+static int glob;      /* so is any backslash, and the field notes *?[ */
+static int wasquoted;
+static int quotedbefore; /* wasquoted as it was before the open quote */
+static int emptyend;     /* len where a quoted "$@" ended in an empty field */
+static struct cbinary *nextsubst;
 
+/* $IFS as a bitmap, rebuilt by changeifs() whenever IFS is assigned */
+static uint32_t ifsmap[256 / 32] = {1 << '\t' | 1 << '\n', 1 << (' ' - 32)};
+static char ifs0 = ' ';
+
+static inline int isifs(int c) {
+  unsigned char u = c;
+  return ifsmap[u >> 5] >> (u & 31) & 1;
+}
+
+/* bytes that end a run of literal text in expandarg() */
+static const char litstop[] = {'\'', '"', '\\', '$', CTLSUBST, '\0'};
+
+/* bytes patcompile() would not take literally */
+static inline int isglobchar(int c) {
+  return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+static struct arg *globfields(struct arg *, struct arg **);
+static void expwords(char *, char *);
+static char *bracevalue(char *);
 static void procvalue(struct cmd *);
+static void arithvalue(struct carith *);
 static void varvalue(const char *);
-static void numappend(int);
+static void paramsappend(int, char **, int);
+static void numappend(intmax_t);
 static void expappend(const char *);
+static void expnappend(const char *, const char *);
+static void memappend(const char *, size_t);
 static void cappend(int);
 
+/* Called with the new value of IFS, or NULL when it is unset. */
+void changeifs(const char *ifs) {
+  const unsigned char *p;
+
+  if (!ifs)
+    ifs = " \t\n";
+  memset(ifsmap, 0, sizeof(ifsmap));
+  for (p = (const unsigned char *)ifs; *p; p++)
+    ifsmap[*p >> 5] |= 1u << (*p & 31);
+  ifs0 = *ifs;
+}
+
 /* Expands a list of args */
 struct arg *expandargs(struct arg *args, int flags) {
   struct arg *head, **cur = &head, *last, *cp;
@@ -57,6 +106,13 @@ char *exparg(struct arg *arg) {
   return arg ? arg->text : "";
 }
 
+/* Like exparg() but for a case pattern, where quoting keeps * and ? from
+ * matching anything. */
+char *exppattern(struct arg *arg) {
+  arg = expandarg(arg, NULL, EXP_NOSPLIT | EXP_PATTERN);
+  return arg ? arg->text : "";
+}
+
 /* v points to the beginning of a variable name after the $ symbol. The
  * return value points to character after the end of the variable name. Any
  * escaped newline sequences are removed from the variable. In that case the
@@ -79,94 +135,631 @@ static inline char *endofvar(char *v) {
   return p;
 }
 
+/* A word that is just "$@" or "$0".."$9" is the parameters as they are, so it
+ * gets their strings in one go. With EXP_NOCOPY the strings are not even
+ * copied: the caller promises to be done with them before the parameters
+ * can change. Returns 0 for any other word. */
+static int paramword(struct arg *arg, int flags, struct arg **res,
+                     struct arg **last) {
+  const char *s = arg->text, *name;
+  struct arg *head = NULL, **app = &head, *ap = NULL;
+  char **pp, *one;
+  int brace, n;
+
+  if (arg->subst || (flags & EXP_HEREDOC) || s[0] != '"' || s[1] != '$')
+    return 0;
+  if ((brace = *(s += 2) == '{'))
+    s++;
+  name = s;
+  if (*s == '@')
+    s++;
+  else
+    while (is_digit(*s))
+      s++;
+  if (s - name != 1 || (brace && *s++ != '}') || strcmp(s, "\""))
+    return 0;
+  /* where the word can't be split, $@ is joined */
+  if (*name == '@' && (flags & EXP_NOSPLIT))
+    return 0;
+
+  if (*name == '@') {
+    pp = shparam.p;
+    n  = shparam.np;
+  } else {
+    n   = *name - '0';
+    one = n == 0 ? arg0 : n <= shparam.np ? shparam.p[n - 1] : NULL;
+    pp  = &one;
+    n   = 1;
+    if (!one)
+      one = nullstr;
+  }
+
+  for (; n > 0; n--, pp++) {
+    *app      = ap = stalloc(sizeof(*ap));
+    ap->text  = flags & EXP_NOCOPY ? *pp : sstrdup(*pp);
+    ap->flags = 0;
+    ap->subst = NULL;
+    app       = &ap->next;
+  }
+  *app = NULL;
+
+  *res = head;
+  if (last)
+    *last = ap;
+  return 1;
+}
+
 struct arg *expandarg(struct arg *arg, struct arg **last, int flags) {
-  int c;
-  int wasquoted = 0;
-  char *s, *p;
   struct arg *first;
-  struct cbinary *subst = arg->subst;
+  char *s;
+
+  if (paramword(arg, flags, &first, last))
+    return first;
 
   first = cur = stalloc(sizeof(*cur));
+  cur->flags  = 0;
 
   // fast path
-  if (!*endofname(arg->text)) {
+  if (arg->flags & ARG_LITERAL) {
     cur->text = sstrdup(arg->text);
     goto fast_path;
   }
 
-  split = flags ^ EXP_NOSPLIT;
-  len     = 0;
-  quote   = 0;
-  expdest = 0;
+  split     = !(flags & EXP_NOSPLIT);
+  heredoc   = flags & EXP_HEREDOC;
+  pattern   = flags & EXP_PATTERN;
+  glob      = split && !fflag;
+  oneword   = heredoc || pattern || !split;
+  splitlit  = 0;
+  len       = 0;
+  quote     = heredoc ? '"' : 0; /* but a " is just a character */
+  expdest   = 0;
+  wasquoted = 0;
+  emptyend  = -1;
+  nextsubst = arg->subst;
+
+  s = arg->text;
+  expwords(s, s + strlen(s));
+
+  if (len == 0) {
+    if (wasquoted) {
+      cappend('\0');
+    } else {
+      /* first stays on the stack, expanding may have allocated past it */
+      return NULL;
+    }
+  } else if (STTOPC(expdest) != '\0' || len == emptyend) {
+    cappend('\0');
+  }
+
+  cur->text = ststrsave(expdest);
+  cur->next = NULL;
+  if (glob)
+    first = globfields(first, &cur);
+fast_path:
+  cur->flags = 0;
+  cur->subst = NULL;
+  cur->next  = NULL;
+
+  if (last)
+    *last = cur;
+
+  return first;
+}
+
+/*
+ * Pathname expansion of the fields from first to *lastp. A field with an
+ * unquoted *?[ is replaced by the files it matches. Any other, or one that
+ * matches nothing, only has its escapes removed.
+ */
+static struct arg *globfields(struct arg *first, struct arg **lastp) {
+  struct arg **app, *ap, *m, *mlast;
+
+  for (app = &first; (ap = *app); app = &ap->next) {
+    if ((ap->flags & ARG_GLOB) && (m = expandpath(ap->text, &mlast))) {
+      mlast->next = ap->next;
+      *app        = m;
+      if (ap == *lastp)
+        *lastp = mlast;
+      ap = mlast;
+    } else if (ap->flags & (ARG_GLOB | ARG_ESCAPED)) {
+      unescape(ap->text);
+    }
+    ap->flags = 0;
+  }
+  return first;
+}
+
+/* Expands the text from s up to end onto the field in progress. */
+static void expwords(char *s, char *end) {
+  int c;
+  char *p;
 
-  for (s = arg->text; (c = *s);) {
-    if (quote == c) {
+  while (s < end) {
+    c = *s;
+    if (quote == c && !heredoc) {
       quote = 0;
     } else if (!quote && (c == '\'' || c == '"')) {
-      quote     = c;
-      wasquoted = 1;
+      quote        = c;
+      quotedbefore = wasquoted;
+      wasquoted    = 1;
     } else if (c == '\\' && !quote) {
-      if ((c = *++s) != '\n')
+      if ((c = *++s) != '\n') {
+        /* an escaped character is quoted */
+        quote = '\\';
         cappend(c);
+        quote = 0;
+      }
     } else if (c == '\\' && quote == '"') {
-      if (!strchr("$\\\"`\n", (c = *++s)))
+      if (!strchr(heredoc ? "$\\`\n" : "$\\\"`\n", (c = *++s)))
         cappend('\\');
       if (c != '\n')
         cappend(c);
     } else if (c == '$' && quote != '\'') {
       if ((c = *++s) == '{') {
-        p = ++s;
-        while ((p = endofvar(p)) && *p != '}')
-          p++;
-        // now we are at the end of the thing
-        if (*p != '}')
-          die("how did this happen?!?!?!?!");
-      } else if (c && strchr("$?@*#0123456789", c)) {
-        // single character variables
-        p = s + 1;
-      } else if ((p = endofvar(s)) == s) {
-        // just a plain $
-        cappend('$');
-        continue;
+        s = bracevalue(s + 1);
+      } else {
+        if (charclass(c, CC_SPECIAL)) {
+          // single character variables
+          p = s + 1;
+        } else if ((p = endofvar(s)) == s) {
+          // just a plain $
+          cappend('$');
+          continue;
+        }
+        // temporarily nul-terminate, but save the character we are clobbering.
+        c  = *p;
+        *p = '\0';
+        varvalue(s);
+        *p = c;
+        s  = p - 1;
       }
-      // temporarily nul-terminate, but save the character we are clobbering.
-      c  = *p;
-      *p = '\0';
-      varvalue(s);
-      *p = c;
-      s += (p - s - 1);
-      if (c == '}')
-        s++;
     } else if (c == CTLSUBST) {
-      assert(subst);
-      procvalue(subst->left);
-      subst = (struct cbinary *)subst->right;
+      assert(nextsubst);
+      if (nextsubst->left->type == CARITH)
+        arithvalue((struct carith *)nextsubst->left);
+      else
+        procvalue(nextsubst->left);
+      nextsubst = (struct cbinary *)nextsubst->right;
     } else {
-      cappend(c);
+      /* c is plain here, copy it along with the run of text after it */
+      p = s + 1 + strcspn(s + 1, litstop);
+      if (p > end)
+        p = end;
+      if (splitlit)
+        expnappend(s, p);
+      else
+        memappend(s, p - s);
+      s = p;
+      continue;
     }
     s++;
   }
+}
 
-  if (len == 0) {
-    if (wasquoted) {
-      cappend('\0');
-    } else {
-      stfree(first);
+/* the end of a parameter name, or s if there is none */
+static char *endofparam(char *s) {
+  if (is_name(*s)) {
+    while (is_in_name(*++s))
+      ;
+  } else if (is_digit(*s)) {
+    while (is_digit(*++s))
+      ;
+  } else if (charclass(*s, CC_SPECIAL)) {
+    s++;
+  }
+  return s;
+}
+
+/*
+ * Scans the word of a ${name<op>word} from s the way word() does, skipping
+ * quotes and nested ${...}. Returns the closing brace, or an earlier `stop`
+ * that is neither quoted nor nested.
+ */
+static char *scanbrace(char *s, int stop) {
+  int c, q = quote, depth = 0;
+
+  for (;; s++) {
+    switch ((c = *s)) {
+    case '\0':
+      raiseerr("bad substitution: missing }");
+    case '\\':
+      if (q != '\'' && s[1])
+        s++;
+      continue;
+    case '\'':
+    case '"':
+      if (!heredoc)
+        q = q == c ? 0 : (q ? q : c);
+      continue;
+    case '$':
+      if (q != '\'' && s[1] == '{') {
+        depth++;
+        s++;
+      }
+      continue;
+    case '}':
+      if (q != '\'' && depth-- == 0)
+        return s;
+      continue;
+    }
+    if (c == stop && !depth && q == quote)
+      return s;
+  }
+}
+
+/* Parks the field in progress, so the stack is free for other strings
+ * until resumefield() puts it back. */
+static char *holdfield(size_t *n) {
+  char *held = NULL;
+
+  if (expdest) {
+    *n      = expdest - (char *)stacknext;
+    held    = ststrsave(expdest);
+    expdest = NULL;
+  }
+  return held;
+}
+
+static void resumefield(char *held, size_t n) {
+  expdest = NULL;
+  if (held) {
+    STARTSTACKSTR(expdest);
+    expdest = stnputs(held, n, expdest);
+  }
+}
+
+/*
+ * Expands the word of an operator from s up to end into a string of its
+ * own. A pattern is not quoted by the double quotes around the ${...}.
+ */
+static char *expsub(char *s, char *end, int pat) {
+  char *savedest = expdest, *res;
+  int savequote = quote, savelen = len, savesplit = split;
+  int savepattern = pattern, saveoneword = oneword, savesplitlit = splitlit;
+  int saveglob = glob;
+
+  if (pat && !heredoc)
+    quote = 0;
+  expdest = NULL;
+  split   = 0;
+  pattern  = pat;
+  glob     = 0;
+  oneword  = 1;
+  splitlit = 0;
+
+  expwords(s, end);
+  if (!expdest)
+    STARTSTACKSTR(expdest);
+  STPUTC('\0', expdest);
+  res = ststrsave(expdest);
+
+  expdest = savedest;
+  quote   = savequote;
+  len     = savelen;
+  split   = savesplit;
+  pattern  = savepattern;
+  glob     = saveglob;
+  oneword  = saveoneword;
+  splitlit = savesplitlit;
+  return res;
+}
+
+/* "$@" or "$*" as one string */
+static char *joinparams(void) {
+  char *p;
+  int i;
+
+  STARTSTACKSTR(p);
+  for (i = 0; i < shparam.np; i++) {
+    if (i)
+      STPUTC(ifs0 ? ifs0 : ' ', p);
+    p = stnputs(shparam.p[i], strlen(shparam.p[i]), p);
+  }
+  STPUTC('\0', p);
+  return ststrsave(p);
+}
+
+/*
+ * The value of a parameter, or NULL if it is unset. Numbers are formatted
+ * into buf. Without join, $@ and $* only say whether they are null.
+ */
+static const char *paramvalue(const char *name, char *buf, int join) {
+  intmax_t n;
+  int num;
+
+  switch (*name) {
+  case '$':
+    num = rootpid;
+    goto num;
+  case '?':
+    num = exitstatus;
+    goto num;
+  case '#':
+    num = shparam.np;
+  num:
+    snprintf(buf, 32, "%d", num);
+    return buf;
+  case '@':
+  case '*':
+    if (!shparam.np)
+      return NULL;
+    if (!join)
+      return shparam.np > 1 ? name : shparam.p[0];
+    return joinparams();
+  }
+  if (is_digit(*name)) {
+    if (atomax10(name, &n) || n > shparam.np)
       return NULL;
+    return n ? shparam.p[n - 1] : arg0;
+  }
+  return lookupvar(name);
+}
+
+/* The length of the longest match of pt at the start of the n bytes at s,
+ * or -1. */
+static long longestmatch(struct pattern *pt, const char *s, size_t n) {
+  long i;
+
+  if (pt->fixed)
+    return (size_t)pt->minlen <= n && patmatch(pt, s, pt->minlen)
+               ? pt->minlen
+               : -1;
+  for (i = n; i >= pt->minlen; i--)
+    if (patmatch(pt, s, i))
+      return i;
+  return -1;
+}
+
+/* ${x#pat}, ${x##pat}, ${x%pat} and ${x%%pat}: how many bytes to drop */
+static size_t trimlen(struct pattern *pt, const char *v, size_t n, int suffix,
+                      int longest) {
+  size_t i;
+
+  if (pt->fixed)
+    return (size_t)pt->minlen <= n &&
+                   patmatch(pt, suffix ? v + n - pt->minlen : v, pt->minlen)
+               ? (size_t)pt->minlen
+               : 0;
+  if (longest) {
+    for (i = n + 1; i-- > (size_t)pt->minlen;)
+      if (patmatch(pt, suffix ? v + n - i : v, i))
+        return i;
+  } else {
+    for (i = pt->minlen; i <= n; i++)
+      if (patmatch(pt, suffix ? v + n - i : v, i))
+        return i;
+  }
+  return 0;
+}
+
+/* ${x/pat/rep}, and with how set to / # or % the other forms */
+static char *replace(struct pattern *pt, const char *v, const char *rep,
+                     int how) {
+  size_t n = strlen(v), done = 0, i;
+  long m;
+  char *d;
+
+  STARTSTACKSTR(d);
+  for (i = 0; i <= n; i++) {
+    if (how == '%')
+      m = patmatch(pt, v + i, n - i) ? (long)(n - i) : -1;
+    else
+      m = longestmatch(pt, v + i, n - i);
+    /* an empty match only counts where it is anchored */
+    if (m > 0 || (m == 0 && (how == '#' || how == '%'))) {
+      d    = stnputs(v + done, i - done, d);
+      d    = stnputs(rep, strlen(rep), d);
+      done = i + m;
+      if (how != '/')
+        break;
+      i = done - 1;
     }
-  } else if (STTOPC(expdest) != '\0') {
-    cappend('\0');
+    if (how == '#')
+      break;
   }
+  d = stnputs(v + done, n - done, d);
+  STPUTC('\0', d);
+  return ststrsave(d);
+}
 
-  cur->text  = ststrsave(expdest);
-fast_path:
-  cur->subst = NULL;
-  cur->next  = NULL;
+/* ${x:off} and ${x:off:len}, negative numbers count from the end */
+static void substring(const char *v, char *word, char *end, const char **r,
+                      size_t *rn) {
+  size_t n = strlen(v);
+  intmax_t off, l = n;
+  char *colon = scanbrace(word, ':');
 
-  if (last)
-    *last = cur;
+  off = arithstr(expsub(word, colon, 0));
+  if (colon < end)
+    l = arithstr(expsub(colon + 1, end, 0));
 
-  return first;
+  if (off < 0)
+    off += n;
+  if (off < 0 || (size_t)off > n)
+    off = n;
+  if (l < 0)
+    l += n - off;
+  else if (l > (intmax_t)(n - off))
+    l = n - off;
+  *r  = v + off;
+  *rn = l < 0 ? 0 : l;
+}
+
+/*
+ * ${@:off} and ${@:off:len}, and the same with *, take the parameters as a
+ * list, $0 first so that an offset of 1 starts at $1. A negative offset
+ * counts back from past the last one.
+ */
+static void sliceparams(int c, char *word, char *end) {
+  char *colon = scanbrace(word, ':'), *held, **pp;
+  intmax_t off, l, n = shparam.np + 1;
+  size_t heldn = 0;
+  int i;
+
+  held = holdfield(&heldn);
+  off  = arithstr(expsub(word, colon, 0));
+  l    = colon < end ? arithstr(expsub(colon + 1, end, 0)) : n;
+  if (l < 0)
+    raiseerr("bad substitution");
+  if (off < 0)
+    off += n;
+  if (off < 0 || off > n)
+    off = n;
+  if (l > n - off)
+    l = n - off;
+
+  pp = stalloc((l + 1) * sizeof(*pp));
+  for (i = 0; i < l; i++)
+    pp[i] = off + i ? shparam.p[off + i - 1] : arg0;
+  resumefield(held, heldn);
+  paramsappend(c, pp, l);
+}
+
+/*
+ * Expands a ${...}, s just past the brace, and returns its closing brace.
+ * `-` and `+` expand their word right into the field in progress. The other
+ * operators work on the value as a string, so the field is parked while
+ * they run.
+ */
+static char *bracevalue(char *s) {
+  char *name = s, *p, *q, *word, *end, *held, *w;
+  const char *v, *r;
+  char buf[32];
+  size_t heldn = 0, rn, drop;
+  int c, op, how = 0, colon = 0, length = 0, unset, outer = quote;
+  int savesplit, savesplitlit;
+  struct pattern *pt;
+
+  /* ${#name} is a length, ${#} and ${#-word} are about $# */
+  if (*s == '#' && (p = endofparam(s + 1)) > s + 1 && *p == '}') {
+    length = 1;
+    name   = s + 1;
+  } else if ((p = endofparam(name)) == name) {
+    raiseerr("bad substitution");
+  }
+
+  q = p;
+  if ((op = *q) == ':') {
+    colon = 1;
+    if (q[1] && strchr("-=?+", q[1]))
+      op = *++q;
+  }
+  word = q + 1;
+  switch (op) {
+  case '}':
+    word = q;
+    break;
+  case '#':
+  case '%':
+  case '/':
+    if (*word == op || (op == '/' && (*word == '#' || *word == '%')))
+      how = *word++;
+    break;
+  case ':':
+  case '-':
+  case '=':
+  case '?':
+  case '+':
+    break;
+  default:
+    raiseerr("bad substitution");
+  }
+  if (length && op != '}')
+    raiseerr("bad substitution");
+  end = op == '}' ? q : scanbrace(word, '}');
+
+  /* the name is nul-terminated in place while it is looked up */
+  c  = *p;
+  *p = '\0';
+  if (op == '}' && !length) {
+    varvalue(name);
+    *p = c;
+    return end;
+  }
+  v     = paramvalue(name, buf, 0);
+  unset = !v || (colon && !*v);
+  if (!unset && (op == '-' || op == '=' || op == '?')) {
+    varvalue(name);
+    *p = c;
+    return end;
+  }
+  *p = c;
+
+  switch (op) {
+  case '+':
+    if (unset)
+      return end;
+    /* fallthrough */
+  case '-':
+    /* nothing splits inside double quotes, even where the word's own quotes
+     * open and close */
+    savesplit    = split;
+    savesplitlit = splitlit;
+    splitlit     = 1;
+    if (quote)
+      split = 0;
+    expwords(word, end);
+    split    = savesplit;
+    splitlit = savesplitlit;
+    quote    = outer;
+    return end;
+  case ':':
+    if (*name == '@' || *name == '*') {
+      sliceparams(*name, word, end);
+      return end;
+    }
+    break;
+  case '=':
+  case '?':
+    held = holdfield(&heldn);
+    w    = expsub(word, end, 0);
+    if (op == '?')
+      raiseerr("%.*s: %s", (int)(p - name), name,
+               *w      ? w
+               : colon ? "parameter null or not set"
+                       : "parameter not set");
+    if (!is_name(*name))
+      raiseerr("%.*s: cannot assign this way", (int)(p - name), name);
+    q = stalloc(p - name + 1);
+    memcpy(q, name, p - name);
+    q[p - name] = '\0';
+    setvar(q, w, 0);
+    resumefield(held, heldn);
+    expappend(w);
+    return end;
+  }
+
+  held = holdfield(&heldn);
+  *p   = '\0';
+  v    = paramvalue(name, buf, 1);
+  *p   = c;
+  if (!v)
+    v = nullstr;
+
+  if (length) {
+    snprintf(buf, sizeof(buf), "%zu",
+             *name == '@' || *name == '*' ? (size_t)shparam.np : strlen(v));
+    r  = buf;
+    rn = strlen(buf);
+  } else if (op == ':') {
+    substring(v, word, end, &r, &rn);
+  } else if (op == '/') {
+    q  = scanbrace(word, '/');
+    pt = patcompile(expsub(word, q, 1));
+    r  = replace(pt, v, q < end ? expsub(q + 1, end, 0) : "", how);
+    rn = strlen(r);
+  } else {
+    pt   = patcompile(expsub(word, end, 1));
+    rn   = strlen(v);
+    drop = trimlen(pt, v, rn, op == '%', how != 0);
+    r    = op == '#' ? v + drop : v;
+    rn  -= drop;
+  }
+
+  resumefield(held, heldn);
+  expnappend(r, r + rn);
+  return end;
 }
 
 static void procvalue(struct cmd *cmd) {
@@ -188,8 +781,6 @@ static void procvalue(struct cmd *cmd) {
   lastc = 0;
   while ((n = read(pip[0], buf, sizeof(buf) - 1)) > 0) {
     buf[n] = '\0';
-    if (lastc && !strchr(IFS, lastc) && strchr(IFS, buf[0]))
-      cappend('\0');
     expappend(buf);
     lastc = buf[n - 1];
   }
@@ -205,6 +796,30 @@ static void procvalue(struct cmd *cmd) {
   }
 }
 
+/*
+ * A $((...)) with expansions in it is expanded like a word in double quotes
+ * and then parsed, the field in progress parked meanwhile.
+ */
+static void arithvalue(struct carith *ca) {
+  struct cbinary *savesubst = nextsubst;
+  char *held, *s;
+  size_t n = 0;
+  intmax_t v;
+
+  if (!ca->expr) {
+    numappend(arith(ca));
+    return;
+  }
+
+  held      = holdfield(&n);
+  nextsubst = ca->expr->subst;
+  s         = ca->expr->text;
+  v         = arithstr(expsub(s, s + strlen(s), 0));
+  nextsubst = savesubst;
+  resumefield(held, n);
+  numappend(v);
+}
+
 static void varvalue(const char *name) {
   int i, num;
   char *p;
@@ -224,21 +839,9 @@ static void varvalue(const char *name) {
   num:
     numappend(num);
     break;
-  case '*':
-    for (i = 0; i < shparam.np; i++) {
-      expappend(shparam.p[i]);
-      if (quote && i + 1 < shparam.np)
-        cappend(IFS[0] ? IFS[0] : ' ');
-      else if (shparam.p[i][0] != '\0')
-        cappend('\0');
-    }
-    break;
   case '@':
-    for (i = 0; i < shparam.np; i++) {
-      expappend(shparam.p[i]);
-      if (quote || shparam.p[i][0] != '\0')
-        cappend('\0');
-    }
+  case '*':
+    paramsappend(*name, shparam.p, shparam.np);
     break;
   case '0':
   case '1':
@@ -252,7 +855,7 @@ static void varvalue(const char *name) {
   case '9':
     DEBUGF("decoding $%s", name);
     for (const char *s = name; *s; s++)
-      if (!isdigit(*s))
+      if (!is_digit(*s))
         raiseerr("bad substitution: not a number");
     i = number(name);
     if (i < 0 || i > shparam.np)
@@ -262,7 +865,7 @@ static void varvalue(const char *name) {
   default:
     // check that the varname is valid
     for (const char *s = name; *s; s++)
-      if (!isalnum(*s) && !strchr("_", *s))
+      if (!is_in_name(*s))
         raiseerr("bad substitution: bad var");
     p = lookupvar(name);
     /* fallthrough */
@@ -273,48 +876,127 @@ static void varvalue(const char *name) {
   }
 }
 
-static void numappend(int n) {
+/* $@ or $*, as c says, made of the n strings at pp */
+static void paramsappend(int c, char **pp, int n) {
+  int i;
+
+  if (c == '@' && !oneword && (quote || split)) {
+    /* no parameters in quotes are no field, if nothing else made one */
+    if (!n && quote == '"' && !len)
+      wasquoted = quotedbefore;
+    /* text right after the last one goes on in its field, an empty one
+     * is only ended if nothing follows */
+    for (i = 0; i < n; i++) {
+      expappend(pp[i]);
+      if (i + 1 < n && (quote || pp[i][0] != '\0'))
+        cappend('\0');
+    }
+    if (n && quote && pp[n - 1][0] == '\0')
+      emptyend = len;
+    return;
+  }
+  /* a here-document, pattern, assignment or redirection is one word, so $@
+   * joins like $* */
+  for (i = 0; i < n; i++) {
+    expappend(pp[i]);
+    if ((quote || !split || oneword) && i + 1 < n)
+      cappend(ifs0 ? ifs0 : ' ');
+    else if (!quote && split && !oneword && pp[i][0] != '\0')
+      cappend('\0');
+  }
+}
+
+static void numappend(intmax_t n) {
   char buf[32];
 
-  snprintf(buf, sizeof(buf), "%d", n);
+  snprintf(buf, sizeof(buf), "%" PRIdMAX, n);
   expappend(buf);
 }
 
-static void expappend(const char *s) {
+static void expappend(const char *s) { expnappend(s, s + strlen(s)); }
+
+static void expnappend(const char *s, const char *end) {
+  const char *p;
+
   if (quote == '"' || !split) {
-    while (*s)
-      cappend(*s++);
+    if (s < end)
+      memappend(s, end - s);
     return;
   }
 
-  int inword = 0;
-
-  const char *p;
-  for (p = s; *p; p++) {
-    if (strchr(IFS, *p)) {
-      if (inword)
-        cappend('\0');
-      inword = 0;
-      do {
-        p++;
-      } while (*p && strchr(IFS, *p));
-      p--;
-    } else {
-      cappend(*p);
-      inword = 1;
-    }
+  /* copy each field in one go, a run of IFS ends the one in progress */
+  for (;;) {
+    for (p = s; s < end && isifs(*s); s++)
+      ;
+    if (s > p && expdest && expdest != stackblock() && STTOPC(expdest) != '\0')
+      cappend('\0');
+    if (s == end)
+      break;
+    for (p = s; p < end && !isifs(*p); p++)
+      ;
+    memappend(s, p - s);
+    s = p;
   }
 }
 
-static void cappend(int c) {
+/* starts a new field if the last one was ended with a nul */
+static inline void startfield(void) {
   if (!expdest) {
     STARTSTACKSTR(expdest);
   } else if (STTOPC(expdest) == '\0') {
     cur->text = ststrsave(expdest);
-    cur->next = stalloc(sizeof(*cur));
-    cur       = cur->next;
+    cur->next  = stalloc(sizeof(*cur));
+    cur        = cur->next;
+    cur->flags = 0;
     STARTSTACKSTR(expdest);
   }
+}
+
+/*
+ * Whether c needs a backslash in a pattern or a field to glob: a quoted
+ * *?[\ does, and in a field so does any \. An unquoted *?[ is noted.
+ */
+static inline int escape(int c) {
+  if (!isglobchar(c))
+    return 0;
+  if (quote || (glob && c == '\\')) {
+    cur->flags |= ARG_ESCAPED;
+    return 1;
+  }
+  if (glob)
+    cur->flags |= ARG_GLOB;
+  return 0;
+}
+
+/* n must not be 0, or an empty field may be started */
+static void memappend(const char *s, size_t n) {
+  const char *p, *e = s + n;
+
+  startfield();
+  len += n;
+  if (!pattern && !glob) {
+    expdest = stnputs(s, n, expdest);
+    return;
+  }
+
+  /* copy the runs between the bytes that may need escaping */
+  for (;; s = p + 1) {
+    for (p = s; p < e && !isglobchar(*p); p++)
+      ;
+    if (p > s)
+      expdest = stnputs(s, p - s, expdest);
+    if (p == e)
+      return;
+    if (escape(*p))
+      STPUTC('\\', expdest);
+    STPUTC(*p, expdest);
+  }
+}
+
+static void cappend(int c) {
+  startfield();
+  if ((pattern || glob) && escape(c))
+    STPUTC('\\', expdest);
   STPUTC(c, expdest);
   len++;
 }
@@ -4,9 +4,14 @@
 
 #define EXP_FULL    (1 << 1)
 #define EXP_NOSPLIT (1 << 2)
+#define EXP_HEREDOC (1 << 3) /* body of an unquoted here-document */
+#define EXP_NOCOPY  (1 << 4) /* "$@" may point at the parameters themselves */
+#define EXP_PATTERN (1 << 5) /* a pattern: quoted characters match themselves */
 
 struct arg *expandargs(struct arg *, int flags);
 struct arg *expandarg(struct arg *, struct arg **, int flags);
 char *exparg(struct arg *arg);
+char *exppattern(struct arg *arg);
+void changeifs(const char *);
 
 #endif
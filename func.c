@@ -2,13 +2,21 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "cmd.h"
+#include "dir.h"
+#include "error.h"
 #include "func.h"
 #include "mem.h"
+#include "parser.h"
+#include "var.h"
+#include "vm.h"
 
 #define FUNCTABSIZE 11
 static struct funcentry *functab[FUNCTABSIZE];
@@ -32,6 +40,7 @@ struct funcentry *lookupfunc(const char *name, int add) {
   if (add && !fp) {
     fp = *pp = xmalloc(sizeof(struct funcentry));
     fp->func = NULL;
+    fp->code = NULL;
     fp->next = NULL;
   }
   return fp;
@@ -45,5 +54,74 @@ void defunc(struct cfunc *cf) {
   if (fp->func) {
     freecmd((struct cmd *)fp->func);
   }
+  if (fp->code) {
+    freecode(fp->code);
+    fp->code = NULL;
+  }
   fp->func = (struct cfunc *)copycmd((struct cmd *)cf);
 }
+
+/* parse the body of a function defined lazily, the first time it is called */
+void loadfunc(struct funcentry *fp) {
+  struct cmd **cpp = &fp->func->body;
+  struct cmd *body;
+  struct cfunc *cf;
+  struct stackmark mark;
+
+  if ((*cpp)->type == CREDIR)
+    cpp = &((struct credir *)*cpp)->cmd;
+  if ((*cpp)->type != CLAZY)
+    return;
+
+  pushstackmark(&mark);
+  body = parselazy((struct clazy *)*cpp);
+
+  INTOFF;
+  *cpp = body;
+  cf   = (struct cfunc *)copycmd((struct cmd *)fp->func);
+  freecmd((struct cmd *)fp->func);
+  fp->func = cf;
+  INTON;
+  popstackmark(&mark);
+}
+
+/*
+ * FPATH
+ *
+ * The directories of FPATH are searched for a file named after a command
+ * that is not found otherwise, in their cached listings. Hidden files are
+ * left out.
+ */
+
+/*
+ * Find the file defining the function `name` in FPATH. Returns its path on
+ * the stack, or NULL.
+ */
+char *fpathfind(const char *name) {
+  const char *p, *q, *fpath = lookupvar("FPATH");
+  struct dirlist *dl;
+  char *path;
+  int len, found;
+
+  if (!fpath || !*fpath || *name == '.' || strchr(name, '/'))
+    return NULL;
+
+  for (p = fpath;; p = q + 1) {
+    q = strchrnul(p, ':');
+    if ((len = q - p) > 0) {
+      path = stalloc(len + strlen(name) + 2);
+      sprintf(path, "%.*s", len, p);
+      INTOFF;
+      found = (dl = dirlist(path)) && dirfind(dl, name);
+      if (dl)
+        freelist(dl);
+      INTON;
+      if (found) {
+        sprintf(path + len, "/%s", name);
+        return path;
+      }
+    }
+    if (!*q)
+      return NULL;
+  }
+}
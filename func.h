@@ -6,10 +6,13 @@
 
 struct funcentry {
   struct cfunc *func;
+  struct code *code; /* compiled body, made on first call */
   struct funcentry *next;
 };
 
 struct funcentry *lookupfunc(const char *, int);
 void defunc(struct cfunc *);
+void loadfunc(struct funcentry *);
+char *fpathfind(const char *);
 
 #endif // FUNC_H
@@ -0,0 +1,167 @@
+/*
+ * \file glob.c
+ *
+ * Pathname expansion. A pattern is matched a component at a time against
+ * the cached listing of each directory it reaches, see dir.c, so a loop
+ * globbing the same directory does not read it every time.
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "dir.h"
+#include "error.h"
+#include "glob.h"
+#include "mem.h"
+#include "str.h"
+
+/*
+ * matching
+ */
+
+struct match {
+  char *s;
+  size_t n;
+};
+
+static char *pbuf; /* the path so far */
+static size_t pcap;
+static struct match *res;
+static size_t nres, rescap;
+
+static void pgrow(size_t n) {
+  if (n > pcap) {
+    while (n > pcap)
+      pcap = pcap ? pcap * 2 : BUFSIZ;
+    pbuf = xrealloc(pbuf, pcap);
+  }
+}
+
+static void addmatch(size_t len) {
+  if (nres == rescap) {
+    rescap = rescap ? rescap * 2 : 32;
+    res    = xrealloc(res, rescap * sizeof(*res));
+  }
+  res[nres].s = stalloc(len + 1);
+  res[nres].n = len;
+  memcpy(res[nres].s, pbuf, len);
+  res[nres++].s[len] = '\0';
+}
+
+/*
+ * Matches the pattern p against the directory whose path is the len bytes
+ * of pbuf, followed by a / unless it is empty. wild says if a component
+ * before was a pattern, else a path that matches nothing literal is not a
+ * match at all.
+ */
+static void globfrom(size_t len, char *p, int wild) {
+  struct pattern *pt;
+  struct dirlist *dl;
+  struct dent *de;
+  struct stat st;
+  char *q;
+  int i, dot;
+
+  /* copy the literal components */
+  for (;;) {
+    if ((q = strchr(p, '/')))
+      *q = '\0';
+    if (ispattern(p))
+      break;
+    pgrow(len + strlen(p) + 2);
+    for (; *p; p++)
+      pbuf[len++] = *p == '\\' && p[1] ? *++p : *p;
+    pbuf[len] = '\0';
+    if (!q) {
+      if (wild && lstat(pbuf, &st) == 0)
+        addmatch(len);
+      return;
+    }
+    *q          = '/';
+    pbuf[len++] = '/';
+    p           = q + 1;
+  }
+
+  /* a leading . is only matched by a . */
+  dot = *p == '.' || (p[0] == '\\' && p[1] == '.');
+  pt  = patcompile(p);
+  if (q)
+    *q = '/';
+  pgrow(len + 1);
+  pbuf[len] = '\0';
+  if (!(dl = dirlist(len ? pbuf : ".")))
+    return;
+
+  dl->busy++;
+  for (i = 0, de = dl->ent; i < dl->n; i++, de++) {
+    if ((de->name[0] == '.' && !dot) || !patmatch(pt, de->name, de->len))
+      continue;
+    pgrow(len + de->len + 2);
+    memcpy(pbuf + len, de->name, de->len);
+    pbuf[len + de->len] = '\0';
+    if (!q) {
+      addmatch(len + de->len);
+      continue;
+    }
+    /* only a directory can have more components matched in it */
+    if (de->type != DT_DIR &&
+        ((de->type != DT_LNK && de->type != DT_UNKNOWN) ||
+         stat(pbuf, &st) < 0 || !S_ISDIR(st.st_mode)))
+      continue;
+    pbuf[len + de->len] = '/';
+    globfrom(len + de->len + 1, q + 1, 1);
+  }
+  dl->busy--;
+  freelist(dl);
+}
+
+/* byte order, which is the collation of the C locale */
+static int matchcmp(const void *a, const void *b) {
+  const struct match *x = a, *y = b;
+  int r = memcmp(x->s, y->s, x->n < y->n ? x->n : y->n);
+
+  return r ? r : (x->n > y->n) - (x->n < y->n);
+}
+
+/*
+ * Expands the pattern pat, as escaped by the expander, to the pathnames it
+ * matches. They are returned sorted, as a list on the stack ending at
+ * *last, or NULL if there are none.
+ */
+struct arg *expandpath(char *pat, struct arg **last) {
+  struct arg *first = NULL, **app = &first, *ap = NULL;
+  size_t i;
+
+  INTOFF;
+  nres = 0;
+  globfrom(0, pat, 0);
+  if (nres)
+    qsort(res, nres, sizeof(*res), matchcmp);
+  INTON;
+
+  for (i = 0; i < nres; i++) {
+    *app      = ap = stalloc(sizeof(*ap));
+    ap->text  = res[i].s;
+    ap->subst = NULL;
+    ap->flags = 0;
+    app       = &ap->next;
+  }
+  *app  = NULL;
+  *last = ap;
+  return first;
+}
+
+/* Removes the escapes from a field that matched nothing, in place. */
+void unescape(char *s) {
+  char *p = s;
+
+  for (; *s; s++) {
+    if (*s == '\\' && s[1])
+      s++;
+    *p++ = *s;
+  }
+  *p = '\0';
+}
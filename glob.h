@@ -0,0 +1,13 @@
+/*
+ * \file glob.h
+ */
+
+#ifndef GLOB_H
+#define GLOB_H
+
+#include "cmd.h"
+
+struct arg *expandpath(char *, struct arg **);
+void unescape(char *);
+
+#endif
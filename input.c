@@ -1,9 +1,13 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "error.h"
@@ -14,26 +18,34 @@
 #include "options.h"
 #include "output.h"
 #include "redir.h"
+#include "str.h"
+
+/* read buffer limits for scripts that are regular files, and other non-ttys */
+#define BUFMAXFILE (1 << 20)
+#define BUFMAXPIPE (1 << 16)
 
 char basebuf[BUFSIZ + 1];
 struct parsefile basepf = {
-    .prev   = NULL,
-    .lineno = 1,
-    .fd     = 0,
-    .nleft  = 0,
-    .lleft  = 0,
-    .buf    = basebuf,
-    .nextc  = basebuf,
-    .unget  = 0,
-    .fname  = "dmsh",
+    .prev    = NULL,
+    .lineno  = 1,
+    .fd      = 0,
+    .nleft   = 0,
+    .lleft   = 0,
+    .buf     = basebuf,
+    .bufsize = BUFSIZ,
+    .bufmax  = BUFSIZ,
+    .nextc   = basebuf,
+    .unget   = 0,
+    .fname   = "dmsh",
 };
 struct parsefile *parsefile = &basepf;
 int whichprompt;
 
 static void pushfile();
 static int preadfd();
-static void setinputfd(int fd, int push);
+static void setinputfd(int fd, int flags);
 static int preadbuffer();
+static void mapfault(int, siginfo_t *, void *);
 
 int pgetc() {
   int c;
@@ -59,13 +71,63 @@ void pungetc() {
     die("pungetc: unget limit(%d) reached", 2);
 }
 
+/*
+ * Consume the run of characters at the read position whose chartab class
+ * matches `cls`, without refilling the buffer. A pointer to the run is
+ * stored in *sp and its length returned; the caller copies it out in bulk
+ * instead of going through pgetc() a byte at a time.
+ */
+int pgetrun(const char **sp, int cls) {
+  struct parsefile *pf = parsefile;
+  const char *p, *end;
+  int n;
+
+  if (pf->unget || pf->nleft <= 0)
+    return 0;
+
+  p   = pf->nextc;
+  end = p + pf->nleft;
+  while (p < end && charclass(*p, cls))
+    p++;
+
+  if ((n = p - pf->nextc) == 0)
+    return 0;
+
+  *sp          = pf->nextc;
+  pf->lastc[1] = n > 1 ? (signed char)p[-2] : pf->lastc[0];
+  pf->lastc[0] = (signed char)p[-1];
+  pf->nextc += n;
+  pf->nleft -= n;
+  return n;
+}
+
 static int preadfd() {
   int nr;
-  char *buf        = parsefile->buf;
+  char *buf = parsefile->buf;
+
+  /* a mapped file is handed out whole by setinputfd() */
+  if (parsefile->maplen)
+    return 0;
+
   parsefile->nextc = buf;
 
 retry:
-  nr = read(parsefile->fd, buf, BUFSIZ);
+  nr = read(parsefile->fd, buf, parsefile->bufsize);
+
+  /* the buffer was filled, read more at once next time */
+  if (nr == parsefile->bufsize && nr < parsefile->bufmax) {
+    int size = nr * 2 < parsefile->bufmax ? nr * 2 : parsefile->bufmax;
+
+    INTOFF;
+    if (buf == basebuf)
+      buf = memcpy(xmalloc(size + 1), buf, nr);
+    else
+      buf = xrealloc(buf, size + 1);
+    parsefile->buf     = buf;
+    parsefile->nextc   = buf;
+    parsefile->bufsize = size;
+    INTON;
+  }
 
   if (nr < 0) {
     if (errno == EINTR)
@@ -83,57 +145,48 @@ retry:
   return nr;
 }
 
+/*
+ * Squeeze the nul chars out of the line [p, end) by moving the rest of it
+ * up against `end`. Returns the new start of the line. Lines are only
+ * touched when they actually contain a nul, so a mapped file stays clean.
+ */
+static char *stripnul(char *p, char *end) {
+  char *r, *w;
+
+  if (!memchr(p, '\0', end - p))
+    return p;
+
+  for (r = w = end; r > p;)
+    if (*--r)
+      *--w = *r;
+  return w;
+}
+
 static int preadbuffer() {
   char *q;
   int more;
 
-  more = parsefile->lleft;
-  if (more <= 0) {
-  again:
-    if ((more = preadfd()) <= 0) {
+  /* Hand out the buffer a line at a time. `nleft` keeps track of chars
+   * left until \n or the end of the buffer. `lleft` keeps track of
+   * additional characters after that until preadfd() should be called. */
+  do {
+    if ((more = parsefile->lleft) <= 0 && (more = preadfd()) <= 0) {
       parsefile->nleft = 0;
+      parsefile->lleft = 0;
       return PEOF;
     }
-  }
-
-  q = parsefile->nextc;
 
-  /* Parse the input buffer removing any nul chars. Ensure that that a \n or
-   * EOF is present (or call preadfd() again). `nleft` keeps track of chars
-   * left until \n or EOF. `lleft` keeps track of additional characters needed
-   * after that until preadfd() should be called. */
-  for (;;) {
-    int c;
+    q = memchr(parsefile->nextc, '\n', more);
+    q = q ? q + 1 : parsefile->nextc + more;
 
-    more--;
-    c = *q;
+    parsefile->lleft = more - (q - parsefile->nextc);
+    parsefile->nextc = stripnul(parsefile->nextc, q);
+  } while (parsefile->nextc == q);
 
-    if (!c) {
-      memmove(q, q + 1, more);
-    } else {
-      q++;
+  parsefile->nleft = q - parsefile->nextc - 1;
 
-      if (c == '\n') {
-        parsefile->nleft = q - parsefile->nextc - 1;
-        break;
-      }
-    }
-
-    if (more <= 0) {
-      parsefile->nleft = q - parsefile->nextc - 1;
-      if (parsefile->nleft < 0)
-        goto again;
-      break;
-    }
-  }
-  parsefile->lleft = more;
-
-  if (vflag) {
-    int savec = *q;
-    *q        = '\0';
-    fputs(parsefile->nextc, stderr);
-    *q = savec;
-  }
+  if (vflag)
+    fwrite(parsefile->nextc, 1, q - parsefile->nextc, stderr);
 
   return (signed char)*parsefile->nextc++;
 }
@@ -150,25 +203,121 @@ int setinputfile(const char *fname, int flags) {
   }
   if (fd < 10)
     fd = savefd(fd);
-  setinputfd(fd, flags & INPUT_PUSH_FILE);
+  setinputfd(fd, flags & (INPUT_PUSH_FILE | INPUT_LAZY));
   parsefile->fname = xstrdup(fname);
 out:
   INTON;
   return fd;
 }
 
+/*
+ * A mapped script that shrinks under us faults with SIGBUS on the pages
+ * past its new end. Put anonymous pages in place of the rest of the mapping
+ * and read the file into them from there, as read() would have, so the
+ * parser sees the file as it is now instead of the shell dying. A fault
+ * anywhere else is left to kill us as it would have.
+ */
+static void mapfault(int sig, siginfo_t *si, void *uc) {
+  static long pagesize;
+  struct parsefile *pf;
+  char *a = si->si_addr, *p;
+  size_t len;
+  off_t off;
+  ssize_t nr;
+  int saved = errno;
+
+  (void)uc;
+  for (pf = parsefile; pf; pf = pf->prev)
+    if (pf->maplen && a >= pf->buf && a < pf->buf + pf->maplen)
+      break;
+  if (!pf)
+    goto dfl;
+
+  if (!pagesize)
+    pagesize = sysconf(_SC_PAGESIZE);
+  off = (a - pf->buf) / pagesize * pagesize;
+  p   = pf->buf + off;
+  len = pf->maplen - off;
+  if (mmap(p, len, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+    goto dfl;
+
+  while (len > 0) {
+    if ((nr = pread(pf->fd, p, len, off)) <= 0) {
+      if (nr < 0 && errno == EINTR)
+        continue;
+      break;
+    }
+    p += nr;
+    off += nr;
+    len -= nr;
+  }
+  errno = saved;
+  return;
+
+dfl:
+  signal(sig, SIG_DFL);
+}
+
+/* files are only mapped once mapfault() is in place */
+static int catchmapfault(void) {
+  static int caught;
+  struct sigaction act;
+
+  if (!caught) {
+    act.sa_flags     = SA_SIGINFO;
+    act.sa_sigaction = mapfault;
+    sigemptyset(&act.sa_mask);
+    caught = sigaction(SIGBUS, &act, NULL) == 0;
+  }
+  return caught;
+}
+
 static void setinputfd(int fd, int flags) {
+  struct stat st;
+  char *map;
+
   if (flags & INPUT_PUSH_FILE) {
     pushfile();
     parsefile->buf = NULL;
+    yytoken        = TNL;
+  }
+  parsefile->fd       = fd;
+  parsefile->isatty   = isatty(parsefile->fd);
+  parsefile->nleft    = 0;
+  parsefile->lleft    = 0;
+  parsefile->seekable = 0;
+  parsefile->lazy     = 0;
+  plineno             = 1;
+
+  /* scripts may be read in big chunks, an interactive terminal may not */
+  if (parsefile->isatty) {
+    parsefile->bufmax = BUFSIZ;
+  } else if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    /* mapped or read in big blocks, so bodies can be scanned in place */
+    parsefile->lazy = flags & INPUT_LAZY;
+    /* walk bigger regular files in place rather than copying them */
+    if (st.st_size > BUFSIZ && st.st_size <= INT_MAX && catchmapfault() &&
+        (map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                    0)) != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      if (parsefile->buf && parsefile->buf != basebuf)
+        free(parsefile->buf);
+      parsefile->buf    = map;
+      parsefile->nextc  = map;
+      parsefile->maplen = st.st_size;
+      parsefile->lleft  = st.st_size;
+      return;
+    }
+    parsefile->bufmax = BUFMAXFILE;
+  } else {
+    parsefile->bufmax = BUFMAXPIPE;
+  }
+
+  if (!parsefile->buf) {
+    parsefile->buf     = xmalloc(BUFSIZ + 1);
+    parsefile->bufsize = BUFSIZ;
   }
-  parsefile->fd     = fd;
-  parsefile->isatty = isatty(parsefile->fd);
-  if (!parsefile->buf)
-    parsefile->buf = xmalloc(BUFSIZ + 1);
-  parsefile->nleft = 0;
-  parsefile->lleft = 0;
-  plineno          = 1;
 }
 
 void setinputstring(char *string, int flags) {
@@ -178,6 +327,7 @@ void setinputstring(char *string, int flags) {
   parsefile->nleft = strlen(string);
   parsefile->buf   = NULL;
   parsefile->fd    = -1;
+  parsefile->lazy  = 0;
   plineno          = 1;
   yytoken          = TNL;
 }
@@ -186,11 +336,22 @@ static void pushfile() {
   struct parsefile *pf;
 
   INTOFF;
-  pf        = xmalloc(sizeof(*pf));
-  pf->prev  = parsefile;
-  pf->fd    = -1;
-  pf->unget = 0;
-  parsefile = pf;
+  pf           = xmalloc(sizeof(*pf));
+  pf->prev     = parsefile;
+  pf->fd       = -1;
+  pf->nleft    = 0;
+  pf->lleft    = 0;
+  pf->unget    = 0;
+  pf->bufsize  = 0;
+  pf->bufmax   = 0;
+  pf->maplen   = 0;
+  pf->seekable = 0;
+  pf->lazy     = 0;
+  pf->cmds     = NULL;
+  pf->ncmds    = 0;
+  pf->fname    = NULL;
+  pf->isatty   = 0;
+  parsefile    = pf;
   INTON;
 }
 
@@ -203,7 +364,9 @@ void popfile() {
     if (pf->fname)
       free(pf->fname);
   }
-  if (pf->buf)
+  if (pf->maplen)
+    munmap(pf->buf, pf->maplen);
+  else if (pf->buf)
     free(pf->buf);
   parsefile = pf->prev;
   yytoken   = TNL;
@@ -211,6 +374,42 @@ void popfile() {
   INTON;
 }
 
+/*
+ * Commands we run share stdin with the parser, so normally it must not
+ * read ahead of them. If stdin is seekable, read it in blocks anyway and
+ * let syncstdin() hand the unparsed part back first.
+ */
+void initstdin(void) {
+  basepf.isatty = isatty(0);
+  if (!basepf.isatty && lseek(0, 0, SEEK_CUR) >= 0) {
+    basepf.seekable = 1;
+    basepf.bufmax   = BUFMAXPIPE;
+  }
+}
+
+/*
+ * Rewind stdin to the parse position, dropping whatever was read ahead.
+ * Must be called before anything else gets to read fd 0.
+ */
+void syncstdin(void) {
+  off_t back;
+
+  if (!basepf.seekable || basepf.fd != 0)
+    return;
+
+  back = basepf.lleft + basepf.unget;
+  if (basepf.nleft > 0)
+    back += basepf.nleft;
+  if (back == 0)
+    return;
+
+  if (lseek(0, -back, SEEK_CUR) >= 0) {
+    basepf.nleft = 0;
+    basepf.lleft = 0;
+    basepf.unget = 0;
+  }
+}
+
 void unwindfiles(struct parsefile *stop) {
   while (parsefile != stop)
     popfile();
@@ -225,6 +424,8 @@ void closescript() {
   if (parsefile->fd != 0) {
     parsefile->fd    = -1;
     parsefile->nleft = 0;
+    parsefile->lleft = 0;
     parsefile->unget = 0;
+    parsefile->ncmds = 0;
   }
 }
@@ -4,9 +4,12 @@
 
 #include <stdio.h>
 
+#include "compile.h"
+
 enum {
   INPUT_PUSH_FILE = 1,
   INPUT_NOFILE_OK = 2,
+  INPUT_LAZY      = 4,
 };
 
 struct parsefile {
@@ -17,6 +20,13 @@ struct parsefile {
   int lleft;
   char *nextc;
   char *buf;
+  int bufsize;
+  int bufmax;
+  size_t maplen; /* buf is a mapping of the whole file */
+  int seekable;  /* stdin, read ahead and seeked back by syncstdin() */
+  int lazy;      /* function bodies may be skipped, see lazybody() */
+  struct compiled *cmds; /* precompiled commands handed out by parseline() */
+  int ncmds;
   int lastc[2];
   int unget;
   char *fname;
@@ -30,12 +40,15 @@ extern struct parsefile *parsefile;
 
 int pgetc(void);
 void pungetc(void);
+int pgetrun(const char **, int);
 int setinputfile(const char *, int);
 void setinputstring(char *, int);
 void popfile(void);
 void unwindfiles(struct parsefile *);
 void popallfiles(void);
 void closescript(void);
+void initstdin(void);
+void syncstdin(void);
 
 #define PEOF (-1)
 
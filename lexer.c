@@ -1,46 +1,93 @@
 
 #include <alloca.h>
 #include <assert.h>
-#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "arith.h"
 #include "cmd.h"
 #include "error.h"
 #include "input.h"
 #include "lexer.h"
 #include "mem.h"
 #include "parser.h"
+#include "str.h"
 #include "var.h"
 
 int show_tokens = 0;
 int yytoken = TNL;
+long ntokens; /* tokens read so far */
 char *yytext;
+int yyleng;
 struct cbinary *subst;
 
+/* set once checkwd() has classified the current word */
+static int wdchecked;
+
 #define LEN(a) (sizeof(a) / sizeof(a[0]))
 
 const char *tokname[] = {
     "TEOF",  "TNL",   "TSEMI", "TSEMIA", "TDSEMI", "TPIPE", "TAND",
     "TOR",   "TBGND", "TLPAR", "TRPAR",  "TLESS",  "TGRTR", "TDLSS",
-    "TDGRT", "TWORD", "TWHLE", "TUNTL",  "TDO",    "TDONE", "TIF",
-    "TTHEN", "TELSE", "TELIF", "TFI",    "TFOR",   "TIN",   "TCASE",
-    "TESAC", "TLBRC", "TRBRC", "TBANG",  NULL,
+    "TDGRT", "TDLSD", "TTLSS", "TWORD",  "TWHLE",  "TUNTL", "TDO",
+    "TDONE", "TIF",   "TTHEN", "TELSE",  "TELIF",  "TFI",   "TFOR",
+    "TIN",   "TCASE", "TESAC", "TLBRC",  "TRBRC",  "TBANG", NULL,
 };
 static_assert(LEN(tokname) == TMAX + 1, "tokname should have length TMAX+1");
 
 const char *toktxt[] = {
-    "<EOF>", "<NL>", ";",  ";&",   ";;",   "|",    "&&",     "||",    "&",
-    "(",     ")",    "<",  ">",    "<<",   ">>",   "<WORD>", "while", "until",
-    "do",    "done", "if", "then", "else", "elif", "fi",     "for",   "in",
-    "case",  "esac", "{",  "}",    "!",    NULL,
+    "<EOF>", "<NL>",   ";",     ";&",    ";;", "|",    "&&",   "||",
+    "&",     "(",      ")",     "<",     ">",  "<<",   ">>",   "<<-",
+    "<<<",   "<WORD>", "while", "until", "do", "done", "if",   "then",
+    "else",  "elif",   "fi",    "for",   "in", "case", "esac", "{",
+    "}",     "!",      NULL,
 };
 static_assert(LEN(toktxt) == TMAX + 1, "tokname should have length TMAX+1");
 
+/*
+ * Perfect hash over the reserved words, keyed on the first and last
+ * character. The slots are computed at compile time; if a new keyword
+ * collides (-Woverride-init complains), tweak the multiplier until every
+ * entry gets its own slot.
+ */
+#define KWHASHSIZE 32
+#define KWMAXLEN   5
+#define KWHASH(first, last)                                                    \
+  ((((unsigned char)(first)) * 5 + (unsigned char)(last)) & (KWHASHSIZE - 1))
+#define KW(tok, s, first, last)                                                \
+  [KWHASH(first, last)] = {tok, sizeof(s) - 1}
+
+static const struct {
+  char tok;
+  char len;
+} kwtab[KWHASHSIZE] = {
+    KW(TWHLE, "while", 'w', 'e'), KW(TUNTL, "until", 'u', 'l'),
+    KW(TDO, "do", 'd', 'o'),      KW(TDONE, "done", 'd', 'e'),
+    KW(TIF, "if", 'i', 'f'),      KW(TTHEN, "then", 't', 'n'),
+    KW(TELSE, "else", 'e', 'e'),  KW(TELIF, "elif", 'e', 'f'),
+    KW(TFI, "fi", 'f', 'i'),      KW(TFOR, "for", 'f', 'r'),
+    KW(TIN, "in", 'i', 'n'),      KW(TCASE, "case", 'c', 'e'),
+    KW(TESAC, "esac", 'e', 'c'),  KW(TLBRC, "{", '{', '{'),
+    KW(TRBRC, "}", '}', '}'),     KW(TBANG, "!", '!', '!'),
+};
+
+/* here-documents whose bodies have not been read yet */
+struct heredoc {
+  struct heredoc *next;
+  struct arg *body;
+  const char *delim;
+  int striptabs;
+  int quoted;
+};
+
+static struct heredoc *heredocs, **heredoctail = &heredocs;
+
 static int readchar(void);
 static int readcharbnl(void);
 static int word(void);
+static struct cmd *readarith(void);
+static void readheredocs(void);
 
 int nexttoken(void) {
   int c;
@@ -50,6 +97,8 @@ repeat:
 
   switch (c) {
   case PEOF:
+    if (heredocs)
+      readheredocs();
     yytoken = TEOF;
     break;
   case ';':
@@ -96,13 +145,23 @@ repeat:
     break;
   case '<':
     if ((c = readcharbnl()) == '<') {
-      yytoken = TDLSS;
+      if ((c = readcharbnl()) == '-') {
+        yytoken = TDLSD;
+      } else if (c == '<') {
+        yytoken = TTLSS;
+      } else {
+        pungetc();
+        yytoken = TDLSS;
+      }
     } else {
       pungetc();
       yytoken = TLESS;
     }
     break;
   case '\n':
+    /* here-document bodies start on the line after their operator */
+    if (heredocs)
+      readheredocs();
     yytoken = TNL;
     break;
   case '#':
@@ -115,8 +174,11 @@ repeat:
     break;
   }
 
+  /* operators share the static token text, it must not be written to */
   if (yytoken != TWORD)
-    yytext = sstrdup(toktxt[yytoken]);
+    yytext = (char *)toktxt[yytoken];
+  wdchecked = 0;
+  ntokens++;
 
   if (show_tokens) {
     printf("nexttoken(): %s `%s`", tokname[yytoken], yytext);
@@ -143,7 +205,7 @@ repeat:
     break;
   default:
     // skip garbage
-    if (!isprint(c) && !ispunct(c) && !isspace(c))
+    if (!charclass(c, CC_TEXT))
       goto repeat;
     break;
   }
@@ -173,34 +235,136 @@ static inline int readchar_optbnl(int eatbnl) {
 /*
  * do NOT skip newlines
  */
-static inline int skipspaces(void) {
+int skipspaces(void) {
   int c;
 
-  while ((c = readcharbnl()) != PEOF && strchr(" \v\r\t", c))
+  while ((c = readcharbnl()) != PEOF && charclass(c, CC_BLANK))
     ; /* advance */
   return c;
 }
 
+/*
+ * Promote the current word to a keyword token if it is one.
+ * The parser asks repeatedly about the same token, so only the first
+ * call per word does any work.
+ */
 int checkwd(void) {
-  if (yytoken != TWORD)
+  int t;
+
+  if (yytoken != TWORD || wdchecked)
     return yytoken;
+  wdchecked = 1;
 
-  for (int i = KWDOFFSET; i < TMAX; i++)
-    if (strcmp(toktxt[i], yytext) == 0)
-      return yytoken = i;
+  if (yyleng == 0 || yyleng > KWMAXLEN)
+    return yytoken;
+
+  t = KWHASH(yytext[0], yytext[yyleng - 1]);
+  if (kwtab[t].tok && kwtab[t].len == yyleng &&
+      memcmp(toktxt[(int)kwtab[t].tok], yytext, yyleng) == 0)
+    yytoken = kwtab[t].tok;
 
   return yytoken;
 }
 
+/*
+ * Read the $(...) or $((...)) after a `$(` and link it to the substitutions
+ * of the word at **cpp. p is the end of the word so far on the stack, which
+ * is set aside while the parser has the stack. Returns its new end.
+ */
+static char *readsubst(char *p, struct cbinary ***cpp) {
+  int savelen = p - (char *)stacknext;
+  char *saveword;
+  struct cmd *c;
+
+  if (savelen > 0) {
+    saveword = alloca(savelen);
+    memcpy(saveword, stacknext, savelen);
+  }
+
+  if (readcharbnl() == '(') {
+    c = readarith();
+  } else {
+    pungetc();
+    yytoken = TLPAR;
+    c       = ((struct cunary *)parsesub())->cmd;
+  }
+  **cpp = (struct cbinary *)bincmd(CLIST, c, NULL);
+  *cpp  = (struct cbinary **)&(**cpp)->right;
+
+  p = growstackto(savelen + 1);
+  if (savelen > 0) {
+    memcpy(p, saveword, savelen);
+    p += savelen;
+  }
+  return p;
+}
+
+/*
+ * Read a $((...)) up to the )) closing it, the $(( already read. Text that
+ * is all literal is parsed now. Otherwise it is kept as a word, to be
+ * expanded and parsed each time.
+ */
+static struct cmd *readarith(void) {
+  int c, depth = 0;
+  char *p, *text;
+  const char *err;
+  struct cbinary *cbase, **cpp = &cbase;
+  struct carith *ca;
+  struct arg *ap;
+
+  STARTSTACKSTR(p);
+  for (;;) {
+    if ((c = readcharbnl()) == PEOF)
+      raiseerr("syntax: missing `))`");
+    if (c == '(') {
+      depth++;
+    } else if (c == ')' && depth-- == 0) {
+      if (readcharbnl() != ')')
+        raiseerr("syntax: missing `))`");
+      break;
+    } else if (c == '\\') {
+      STPUTC(c, p);
+      if ((c = readchar()) == PEOF)
+        continue;
+    } else if (c == '$') {
+      if (readcharbnl() == '(') {
+        p = readsubst(p, &cpp);
+        c = CTLSUBST;
+      } else {
+        pungetc();
+      }
+    } else if (c == '\n') {
+      setprompt(2);
+    }
+    STPUTC(c, p);
+  }
+  STPUTC('\0', p);
+  text = ststrsave(p);
+  *cpp = NULL;
+
+  /* a bad expression is only an error if it is evaluated */
+  if (!cbase && !strpbrk(text, "$'\"\\") && (ca = arithparse(text, &err)))
+    return (struct cmd *)ca;
+
+  ap        = stalloc(sizeof(*ap));
+  ap->text  = text;
+  ap->next  = NULL;
+  ap->subst = cbase;
+  ap->flags = 0;
+  ca        = (struct carith *)arithcmd(0, 0);
+  ca->expr  = ap;
+  return (struct cmd *)ca;
+}
+
 /*
  * grab a WORD
  */
 static int word(void) {
-  int c;
-  char *ypp, *saveword;
+  int c, n;
+  char *ypp;
+  const char *run;
 
   struct cbinary *cbase, **cpp;
-  struct cunary *cu;
 
   int str = 0;
   int brace = 0;
@@ -208,37 +372,26 @@ static int word(void) {
 
   STARTSTACKSTR(ypp);
 
-  while ((c = readchar_optbnl(str != '\'')) != PEOF) {
-    if (!str && !brace && strchr(" ()<>&\n\t\r\v;|", c)) {
+  for (;;) {
+    /* copy runs of plain characters straight out of the input buffer */
+    if (!str && !brace && (n = pgetrun(&run, CC_WORD)) > 0)
+      ypp = stnputs(run, n, ypp);
+
+    if ((c = readchar_optbnl(str != '\'')) == PEOF)
+      break;
+
+    if (!str && !brace && charclass(c, CC_DELIM)) {
       pungetc();
       break;
     }
 
     if (c == '$' && str != '\'') {
       if ((c = readcharbnl()) == '(') {
-        /* save the stack string */
-        int savelen = ypp - stacknext;
-        if (savelen > 0) {
-          saveword = alloca(savelen);
-          memcpy(saveword, stacknext, savelen);
-        }
-
-        /* parse cmd substitution */
-        yytoken = TLPAR;
-        cu = (struct cunary *)parsesub();
-        *cpp = (struct cbinary *)bincmd(CLIST, cu->cmd, NULL);
-        cpp = (struct cbinary **)&(*cpp)->right;
-
-        /* restore the stack string */
-        ypp = growstackto(savelen + 1);
-        if (savelen > 0) {
-          memcpy(ypp, saveword, savelen);
-          ypp += savelen;
-        }
-        c = CTLSUBST;
+        ypp = readsubst(ypp, &cpp);
+        c   = CTLSUBST;
       } else {
         if (c == '{')
-          brace = '}';
+          brace++;
         c = '$';
         pungetc();
       }
@@ -248,8 +401,9 @@ static int word(void) {
     if (c == '\'' || c == '"')
       str = str == c ? 0 : (str ? str : c);
 
-    if (brace && c == brace)
-      brace = 0;
+    /* ${...} nest, and the word of an operator may have blanks */
+    if (brace && c == '}' && str != '\'')
+      brace--;
 
     if (c == '\\' && str != '\'') {
       assert((c = readchar()) != '\n');
@@ -269,6 +423,7 @@ static int word(void) {
     /* not reached */
   }
 
+  yyleng = ypp - (char *)stacknext;
   STPUTC('\0', ypp);
   yytext = ststrsave(ypp);
   *cpp = NULL;
@@ -277,6 +432,537 @@ static int word(void) {
   return TWORD;
 }
 
+/*
+ * Queue a here-document. Its body is read into `body` once the lexer
+ * reaches the end of the current line. With `quoted` the body is taken
+ * literally, otherwise $ and $( are recognized as in a double-quoted word.
+ */
+void pushheredoc(struct arg *body, const char *delim, int striptabs,
+                 int quoted) {
+  struct heredoc *hp;
+
+  hp            = stalloc(sizeof(*hp));
+  hp->next      = NULL;
+  hp->body      = body;
+  hp->delim     = delim;
+  hp->striptabs = striptabs;
+  hp->quoted    = quoted;
+  *heredoctail  = hp;
+  heredoctail   = &hp->next;
+}
+
+/* forget queued here-documents after a syntax error */
+void dropheredocs(void) {
+  heredocs    = NULL;
+  heredoctail = &heredocs;
+}
+
+static void readheredoc(struct heredoc *hp) {
+  int c;
+  const char *d;
+  char *p;
+  int literal = 1;
+
+  struct cbinary *cbase, **cpp;
+
+  cpp = &cbase;
+  STARTSTACKSTR(p);
+
+  for (;;) {
+    setprompt(2);
+    c = readchar();
+    if (hp->striptabs)
+      while (c == '\t')
+        c = readchar();
+
+    /* the delimiter on a line of its own ends the body */
+    for (d = hp->delim; *d && c == *d; d++)
+      c = readchar();
+    if (!*d && (c == '\n' || c == PEOF))
+      break;
+    p = stnputs(hp->delim, d - hp->delim, p);
+
+    for (; c != '\n' && c != PEOF; c = readchar()) {
+      if (hp->quoted)
+        goto put;
+
+      if (c == '\\') {
+        /* keep the escape for expansion, it also joins lines */
+        literal = 0;
+        STPUTC(c, p);
+        if ((c = readchar()) == PEOF)
+          break;
+      } else if (c == '$') {
+        literal = 0;
+        if ((c = readchar()) == '(') {
+          p = readsubst(p, &cpp);
+          c = CTLSUBST;
+        } else {
+          pungetc();
+          c = '$';
+        }
+      }
+    put:
+      STPUTC(c, p);
+    }
+    if (c == PEOF)
+      break;
+    STPUTC('\n', p);
+  }
+
+  STPUTC('\0', p);
+  *cpp            = NULL;
+  hp->body->text  = ststrsave(p);
+  hp->body->subst = cbase;
+  hp->body->flags = literal ? ARG_LITERAL : 0;
+}
+
+/*
+ * Read the bodies queued so far. A command substitution inside a body can
+ * queue here-documents of its own, so the list is detached first.
+ */
+static void readheredocs(void) {
+  struct heredoc *hp = heredocs;
+
+  dropheredocs();
+  for (; hp; hp = hp->next)
+    readheredoc(hp);
+}
+
+/*
+ * Lazy function bodies
+ *
+ * The body of a function defined in a sourced file is not parsed until the
+ * function is called. Instead its text is scanned in the input buffer for
+ * the } closing it, following only what decides where a command list ends:
+ * quoting, substitutions, nested lists, case patterns and here-documents.
+ * Anything the scan is not sure about makes it give up, and the body is
+ * parsed as usual.
+ */
+
+#define SKIPHERE  8  /* here-documents pending on a line */
+#define SKIPDELIM 64 /* longest here-document delimiter */
+
+struct skip {
+  const char *p;
+  const char *end;
+  int lines;
+  int nhere;
+  struct skiphere {
+    char delim[SKIPDELIM];
+    int striptabs;
+    int quoted;
+  } here[SKIPHERE];
+};
+
+#define ISWORD(w, len, s) ((len) == sizeof(s) - 1 && memcmp(w, s, len) == 0)
+
+static int skiplist(struct skip *, int);
+static int skipsubst(struct skip *);
+
+/* skip a $((...)) the way readarith() reads it, s->p past the $(( */
+static int skiparith(struct skip *s) {
+  int c, depth = 0;
+
+  for (;;) {
+    if (s->p == s->end || !(c = *s->p++))
+      return -1;
+    switch (c) {
+    case '\n':
+      s->lines++;
+      break;
+    case '\\':
+      if (s->p == s->end)
+        return -1;
+      if (*s->p++ == '\n')
+        s->lines++;
+      break;
+    case '(':
+      depth++;
+      break;
+    case ')':
+      if (depth-- == 0)
+        return s->p < s->end && *s->p++ == ')' ? 0 : -1;
+      break;
+    case '$':
+      if (s->p < s->end && *s->p == '(' && skipsubst(s) < 0)
+        return -1;
+      break;
+    }
+  }
+}
+
+/* skip a $(...) or $((...)), s->p at the first ( */
+static int skipsubst(struct skip *s) {
+  if (++s->p < s->end && *s->p == '(') {
+    s->p++;
+    return skiparith(s);
+  }
+  return skiplist(s, ')');
+}
+
+/* skip a word the way word() reads it */
+static int skipword(struct skip *s) {
+  int c, str = 0, brace = 0;
+
+  for (;;) {
+    if (s->p == s->end || !(c = *s->p))
+      return -1;
+    if (!str && !brace && charclass(c, CC_DELIM))
+      return 0;
+    s->p++;
+
+    if (c == '\\' && str != '\'') {
+      if (s->p == s->end)
+        return -1;
+      if (*s->p++ == '\n')
+        s->lines++;
+      continue;
+    }
+    if (c == '\n')
+      s->lines++;
+
+    if (c == '$' && str != '\'' && s->p < s->end) {
+      if (*s->p == '(') {
+        if (skipsubst(s) < 0)
+          return -1;
+      } else if (*s->p == '{') {
+        brace++;
+      } else if (*s->p == '\\') {
+        return -1;
+      }
+      continue;
+    }
+
+    if (c == '\'' || c == '"')
+      str = str == c ? 0 : (str ? str : c);
+    if (brace && c == '}' && str != '\'')
+      brace--;
+  }
+}
+
+static int addheredoc(struct skip *s, const char *w, int len, int striptabs) {
+  struct skiphere *hp;
+
+  if (s->nhere == SKIPHERE || len >= SKIPDELIM || memchr(w, '\n', len))
+    return -1;
+  hp = &s->here[s->nhere++];
+  memcpy(hp->delim, w, len);
+  hp->delim[len] = '\0';
+  hp->quoted     = unquote(hp->delim);
+  hp->striptabs  = striptabs;
+  return 0;
+}
+
+/* skip a here-document body the way readheredoc() reads it */
+static int skipheredoc(struct skip *s, struct skiphere *hp) {
+  size_t len = strlen(hp->delim);
+  int c;
+
+  for (;;) {
+    if (hp->striptabs)
+      while (s->p < s->end && *s->p == '\t')
+        s->p++;
+    if ((size_t)(s->end - s->p) > len && memcmp(s->p, hp->delim, len) == 0 &&
+        s->p[len] == '\n') {
+      s->p += len + 1;
+      s->lines++;
+      return 0;
+    }
+
+    for (;;) {
+      if (s->p == s->end || !(c = *s->p++))
+        return -1;
+      if (c == '\n') {
+        s->lines++;
+        break;
+      }
+      if (hp->quoted)
+        continue;
+      if (c == '\\') {
+        if (s->p == s->end)
+          return -1;
+        if (*s->p++ == '\n')
+          s->lines++;
+      } else if (c == '$' && s->p < s->end && *s->p == '(') {
+        if (skipsubst(s) < 0)
+          return -1;
+      }
+    }
+  }
+}
+
+/* skip the bodies queued on the line just ended */
+static int skipheredocs(struct skip *s) {
+  struct skiphere here[SKIPHERE];
+  int i, n = s->nhere;
+
+  memcpy(here, s->here, n * sizeof(*here));
+  s->nhere = 0;
+  for (i = 0; i < n; i++)
+    if (skipheredoc(s, &here[i]) < 0)
+      return -1;
+  return 0;
+}
+
+/*
+ * Skip a command list up to and including `close`, either } or ). A
+ * reserved word counts only where the parser looks for one: at the start
+ * of a command, and for } and esac right after a separator.
+ */
+static int skiplist(struct skip *s, int close) {
+  int c, len, here;
+  int cmdpos   = 1; /* at the start of a command */
+  int sep      = 0; /* right after ; & or a newline */
+  int name     = 0; /* after the first word of a command */
+  int forwd    = 0; /* words since for */
+  int casewd   = 0; /* words since case, up to in */
+  int ncase    = 0; /* open case commands */
+  int inpat    = 0; /* in a case pattern */
+  int patstart = 0; /* before the first word of the pattern */
+  const char *w;
+
+  for (;;) {
+    if (s->p == s->end)
+      return -1;
+    c = *s->p;
+
+    if (charclass(c, CC_BLANK)) {
+      s->p++;
+      continue;
+    }
+    if (c == '\\' && s->p + 1 < s->end && s->p[1] == '\n') {
+      s->p += 2;
+      s->lines++;
+      continue;
+    }
+
+    switch (c) {
+    case '#':
+      while (s->p < s->end && *s->p != '\n')
+        s->p++;
+      continue;
+
+    case '\n':
+      s->p++;
+      s->lines++;
+      if (s->nhere && skipheredocs(s) < 0)
+        return -1;
+      if (!inpat && !casewd)
+        cmdpos = sep = 1;
+      forwd = name = 0;
+      continue;
+
+    case ';':
+      s->p++;
+      if (s->p < s->end && (*s->p == ';' || *s->p == '&')) {
+        s->p++;
+        if (!ncase || inpat || casewd)
+          return -1;
+        inpat = patstart = 1;
+        continue;
+      }
+      if (inpat || casewd)
+        return -1;
+      cmdpos = sep = 1;
+      forwd = name = 0;
+      continue;
+
+    case '&':
+    case '|':
+      s->p++;
+      len = s->p < s->end && *s->p == c;
+      s->p += len;
+      if (inpat && c == '|' && !len)
+        continue;
+      if (inpat || casewd)
+        return -1;
+      cmdpos = 1;
+      sep    = c == '&' && !len;
+      forwd = name = 0;
+      continue;
+
+    case '(':
+      s->p++;
+      if (inpat) {
+        if (!patstart)
+          return -1;
+        patstart = 0;
+        continue;
+      }
+      if (casewd)
+        return -1;
+      if (cmdpos) {
+        if (skiplist(s, ')') < 0)
+          return -1;
+        cmdpos = sep = name = 0;
+        continue;
+      }
+      /* name() starts a function definition, its body follows */
+      while (s->p < s->end && charclass(*s->p, CC_BLANK))
+        s->p++;
+      if (!name || s->p == s->end || *s->p != ')')
+        return -1;
+      s->p++;
+      cmdpos = 1;
+      sep = name = 0;
+      continue;
+
+    case ')':
+      s->p++;
+      if (inpat) {
+        inpat  = 0;
+        cmdpos = 1;
+        sep    = 0;
+        continue;
+      }
+      if (close != ')' || ncase || casewd)
+        return -1;
+      return 0;
+
+    case '<':
+    case '>':
+      s->p++;
+      here = 0;
+      if (c == '<' && s->p < s->end && *s->p == '<') {
+        s->p++;
+        if (s->p < s->end && *s->p == '<')
+          s->p++;
+        else if (s->p < s->end && *s->p == '-')
+          s->p++, here = 2;
+        else
+          here = 1;
+      } else if (c == '>' && s->p < s->end && *s->p == '>') {
+        s->p++;
+      }
+      if (inpat || casewd)
+        return -1;
+
+      while (s->p < s->end && charclass(*s->p, CC_BLANK))
+        s->p++;
+      w = s->p;
+      if (w == s->end || charclass(*w, CC_DELIM) || skipword(s) < 0)
+        return -1;
+      if (here && addheredoc(s, w, s->p - w, here == 2) < 0)
+        return -1;
+      cmdpos = sep = name = 0;
+      continue;
+    }
+
+    if (!charclass(c, CC_TEXT))
+      return -1;
+    w = s->p;
+    if (skipword(s) < 0)
+      return -1;
+    len = s->p - w;
+
+    if (casewd) {
+      /* case word in */
+      if (casewd++ == 1)
+        continue;
+      if (!ISWORD(w, len, "in"))
+        return -1;
+      casewd = 0;
+      ncase++;
+      inpat = patstart = 1;
+      continue;
+    }
+
+    if (inpat) {
+      if (patstart && ISWORD(w, len, "esac")) {
+        ncase--;
+        inpat  = 0;
+        cmdpos = sep = 0;
+      }
+      patstart = 0;
+      continue;
+    }
+
+    /* for name do */
+    if (forwd && forwd++ == 2 && ISWORD(w, len, "do")) {
+      cmdpos = 1;
+      forwd = sep = 0;
+      continue;
+    }
+
+    if (!cmdpos) {
+      name = 0;
+      continue;
+    }
+
+    if (ISWORD(w, len, "}")) {
+      if (!sep || close != '}' || ncase)
+        return -1;
+      return 0;
+    } else if (ISWORD(w, len, "{")) {
+      if (skiplist(s, '}') < 0)
+        return -1;
+      cmdpos = sep = 0;
+    } else if (ISWORD(w, len, "esac")) {
+      if (!ncase || !sep)
+        return -1;
+      ncase--;
+      cmdpos = sep = 0;
+    } else if (ISWORD(w, len, "case")) {
+      casewd = 1;
+    } else if (ISWORD(w, len, "for")) {
+      forwd  = 1;
+      cmdpos = sep = 0;
+    } else if (ISWORD(w, len, "if") || ISWORD(w, len, "then") ||
+               ISWORD(w, len, "else") || ISWORD(w, len, "elif") ||
+               ISWORD(w, len, "while") || ISWORD(w, len, "until") ||
+               ISWORD(w, len, "do") || ISWORD(w, len, "!")) {
+      sep = 0;
+    } else {
+      name   = 1;
+      cmdpos = sep = 0;
+    }
+  }
+}
+
+/*
+ * With the parser on the { of a function body, skip the body in the input
+ * buffer and return it as a CLAZY node, leaving the lexer on the closing }.
+ * Returns NULL, with nothing read, if the body can't be skipped.
+ */
+struct cmd *lazybody(void) {
+  struct parsefile *pf = parsefile;
+  struct clazy *cz;
+  struct skip s;
+  const char *start;
+
+  if (heredocs || pf->unget != 1 || pf->lastc[0] == PEOF || pf->nleft < 0)
+    return NULL;
+
+  /* the character that ended the { was pushed back */
+  start   = pf->nextc - 1;
+  s.p     = start;
+  s.end   = pf->nextc + pf->nleft + pf->lleft;
+  s.lines = 0;
+  s.nhere = 0;
+  if (skiplist(&s, '}') < 0)
+    return NULL;
+
+  /* ended with a newline, so errors on the last line get its number */
+  cz          = (struct clazy *)lazycmd(s.p - start + 2, plineno, pfname);
+  cz->text[0] = '{';
+  memcpy(cz->text + 1, start, s.p - start);
+  cz->text[s.p - start + 1] = '\n';
+
+  /* hand the rest of the buffer to preadbuffer() */
+  pf->unget    = 0;
+  pf->lastc[0] = '}';
+  pf->nextc    = (char *)s.p;
+  pf->nleft    = 0;
+  pf->lleft    = s.end - s.p;
+  plineno += s.lines;
+
+  yytoken   = TRBRC;
+  yytext    = (char *)toktxt[TRBRC];
+  wdchecked = 1;
+  return (struct cmd *)cz;
+}
+
 void setprompt(int which) {
   if (parsefile->isatty) {
     switch (which) {
@@ -18,33 +18,37 @@
 #define TGRTR  12
 #define TDLSS  13
 #define TDGRT  14
-#define TWORD  15
-#define TWHLE  16
-#define TUNTL  17
-#define TDO    18
-#define TDONE  19
-#define TIF    20
-#define TTHEN  21
-#define TELSE  22
-#define TELIF  23
-#define TFI    24
-#define TFOR   25
-#define TIN    26
-#define TCASE  27
-#define TESAC  28
-#define TLBRC  29
-#define TRBRC  30
-#define TBANG  31
-#define TMAX   32
-
-#define KWDOFFSET 16
+#define TDLSD  15
+#define TTLSS  16
+#define TWORD  17
+#define TWHLE  18
+#define TUNTL  19
+#define TDO    20
+#define TDONE  21
+#define TIF    22
+#define TTHEN  23
+#define TELSE  24
+#define TELIF  25
+#define TFI    26
+#define TFOR   27
+#define TIN    28
+#define TCASE  29
+#define TESAC  30
+#define TLBRC  31
+#define TRBRC  32
+#define TBANG  33
+#define TMAX   34
+
+#define KWDOFFSET 18
 static_assert(KWDOFFSET == TWHLE, "Keyword sanity check");
 
 #include "cmd.h"
 
 extern int show_tokens;
 extern int yytoken;
+extern long ntokens;
 extern char *yytext;
+extern int yyleng;
 extern struct cbinary *subst;
 extern const char *tokname[];
 extern const char *toktxt[];
@@ -54,6 +58,9 @@ int skipspaces(void);
 int checkwd(void);
 void setprompt(int);
 void consumeline(int);
+void pushheredoc(struct arg *, const char *, int, int);
+void dropheredocs(void);
+struct cmd *lazybody(void);
 
 #define CTLSUBST (-125)
 
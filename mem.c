@@ -38,6 +38,7 @@ struct stack_block *stackp = &stackbase;
 char *stacknext            = stackbase.space;
 size_t stacknleft          = MINSIZE;
 char *sstrend              = stackbase.space + MINSIZE;
+size_t stallocated; /* bytes handed out by stalloc() */
 
 void *stalloc(size_t n) {
   char *p;
@@ -63,6 +64,7 @@ void *stalloc(size_t n) {
     stackp     = sp;
   }
   p = stacknext;
+  stallocated += aligned;
   stacknext += aligned;
   stacknleft -= aligned;
   return p;
@@ -124,6 +126,7 @@ static void growstackblock(size_t min) {
     /* free the space we just allocated */
     stacknext = memcpy(p, oldspace, oldlen);
     stacknleft += newlen;
+    stallocated -= MEMALIGN(newlen);
   }
 }
 
@@ -146,6 +149,23 @@ char *stputs(const char *s, char *p) {
   return p;
 }
 
+/* makes room for n more bytes after p, which is returned moved along with
+ * the stack string if it had to grow */
+char *streserve(size_t n, char *p) {
+  size_t off = p - stacknext;
+
+  if ((size_t)(sstrend - p) < n)
+    p = growstackto(off + n) + off;
+  return p;
+}
+
+/* like stputs() but copies n bytes in one go */
+char *stnputs(const char *s, size_t n, char *p) {
+  p = streserve(n, p);
+  memcpy(p, s, n);
+  return p + n;
+}
+
 char *sstrdup(const char *s) {
   size_t len = strlen(s) + 1;
   return memcpy(stalloc(len), s, len);
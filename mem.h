@@ -25,6 +25,7 @@ void popstackmark(struct stackmark *);
 extern char *stacknext;
 extern size_t stacknleft;
 extern char *sstrend;
+extern size_t stallocated;
 
 void *xmalloc(size_t);
 void *xrealloc(void *, size_t);
@@ -35,7 +36,9 @@ void stfree(void *);
 
 void *growstackstr();
 char *growstackto(size_t);
+char *streserve(size_t, char *);
 char *stputs(const char *, char *);
+char *stnputs(const char *, size_t, char *);
 char *sstrdup(const char *);
 
 static inline char *_STPUTC(int c, char *p) {
@@ -3,11 +3,14 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "compile.h"
 #include "error.h"
 #include "input.h"
 #include "mem.h"
 #include "options.h"
+#include "parser.h"
 #include "str.h"
 
 char *arg0;
@@ -18,12 +21,16 @@ struct shparam shparam = {0};
 //     "stdin",
 //     "xtrace",
 //     "verbose",
+//     "noexec",
+//     "noglob",
 // };
 
 const char optletters[NOPTS] = {
     's',
     'x',
     'v',
+    'n',
+    'f',
 };
 
 char optlist[NOPTS];
@@ -109,6 +116,12 @@ int procargs(char **argv) {
 
   if (argv[0])
     argv++;
+
+  if (*argv && strcmp(*argv, "--compile") == 0)
+    exit(compile_scripts(argv + 1));
+  if (*argv && strcmp(*argv, "--parse-stats") == 0)
+    exit(parse_stats(argv + 1));
+
   for (int i = 0; i < NOPTS; i++)
     optlist[i] = 2;
 
@@ -130,6 +143,7 @@ int procargs(char **argv) {
       goto setarg0;
   } else if (!sflag) {
     setinputfile(*argv, 0);
+    loadcompiled(*argv);
   setarg0:
     arg0 = *argv++;
     // commandname = arg0;
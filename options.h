@@ -16,8 +16,10 @@ extern char *minusc;
 #define sflag optlist[0]
 #define xflag optlist[1]
 #define vflag optlist[2]
+#define nflag optlist[3]
+#define fflag optlist[4]
 
-#define NOPTS 3
+#define NOPTS 5
 
 extern const char optletters[NOPTS];
 extern char optlist[NOPTS];
@@ -15,11 +15,12 @@
 #include "output.h"
 
 /*
- * Like perror but with formatting
+ * Like perror but with formatting, prefixed with name and the line number
  */
-void vpreperrorf(const char *pre, const char *fmt, va_list ap) {
+void vpreperrorf(const char *name, const char *pre, const char *fmt,
+                 va_list ap) {
   const char *prefmt = commandname ? "%s: %d: %s: " : "%s: %d: ";
-  fprintf(stderr, prefmt, arg0, plineno - 1, commandname);
+  fprintf(stderr, prefmt, name, plineno - 1, commandname);
   if (pre)
     fputs(pre, stderr);
   vfprintf(stderr, fmt, ap);
@@ -33,7 +34,7 @@ void vpreperrorf(const char *pre, const char *fmt, va_list ap) {
 }
 
 void vperrorf(const char *fmt, va_list ap) {
-  vpreperrorf(NULL, fmt, ap);
+  vpreperrorf(arg0, NULL, fmt, ap);
 }
 
 void perrorf(const char *fmt, ...) {
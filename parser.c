@@ -1,15 +1,31 @@
 
 #include <assert.h>
+#include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "cmd.h"
 #include "error.h"
+#include "eval.h"
 #include "input.h"
 #include "lexer.h"
 #include "mem.h"
+#include "options.h"
 #include "parser.h"
 #include "str.h"
 
+/* commands of a list are collected here until it is complete */
+struct cmdlist {
+  struct cmdlist *next;
+  struct cmd *cmd;
+};
+
+/* redirections are collected here until their command is complete */
+struct redirlist {
+  struct redirlist *next;
+  struct redir r;
+};
+
 static struct cmd *parselist(void);
 static struct cmd *parsecond(void);
 static struct cmd *parsepipe(void);
@@ -23,8 +39,11 @@ static struct cmd *parsefor(void);
 static struct cmd *parsecase(void);
 static struct cmd *parseelse(void);
 static struct cmd *parsesimple(void);
-static struct cmd *parseredir(struct cmd *);
+static struct redirlist **parseredir(struct redirlist **);
+static struct cmd *redirect(struct cmd *, struct redirlist *);
 static struct cmd *parsefunc(char *);
+static struct cmdlist **addcmd(struct cmdlist **, struct cmd *);
+static struct cmd *sequence(struct cmdlist *);
 
 static void expecting(int) __attribute__((noreturn));
 static inline void unexpected(void) __attribute__((noreturn));
@@ -36,11 +55,21 @@ static int sequential_sep(void);
 static int newline_list(void);
 static void linebreak(void);
 static int ionumber(const char *);
+static void setword(struct arg *);
 
 struct cmd *parseline(void) {
+  if (parsefile->cmds) {
+    if (parsefile->ncmds <= 0)
+      return NULL;
+    parsefile->ncmds--;
+    plineno = parsefile->cmds->lineno;
+    return parsefile->cmds++->cmd;
+  }
+
   if (yytoken == TEOF)
     return NULL;
 
+  dropheredocs();
   do {
     setprompt(1);
   } while (nexttoken() == TNL);
@@ -57,18 +86,25 @@ struct cmd *parseline(void) {
 }
 
 static struct cmd *parselist(void) {
-  int op, cont;
+  struct cmdlist *cl, **clp = &cl;
   struct cmd *c;
 
-  c = parsecond();
-
-  while (yytoken == TSEMI || yytoken == TBGND) {
-    op = yytoken == TSEMI ? CLIST : CBGND;
+  for (;;) {
+    c = parsecond();
+    if (yytoken != TSEMI && yytoken != TBGND) {
+      clp = addcmd(clp, c);
+      break;
+    }
+    /* only the command before the & goes to the background */
+    if (yytoken == TBGND)
+      c = bincmd(CBGND, c, NULL);
+    clp = addcmd(clp, c);
     nexttoken();
-    cont = yytoken != TNL && yytoken != TEOF;
-    c = bincmd(op, c, cont ? parsecond() : NULL);
+    if (yytoken == TNL || yytoken == TEOF)
+      break;
   }
-  return c;
+  *clp = NULL;
+  return sequence(cl);
 }
 
 static struct cmd *parsecond(void) {
@@ -135,6 +171,7 @@ static struct cmd *parsecmd(void) {
 
 static struct cmd *parsecmpcmd(void) {
   struct cmd *cmd;
+  struct redirlist *rl;
 
   switch (checkwd()) {
   case TLBRC:
@@ -160,9 +197,9 @@ static struct cmd *parsecmpcmd(void) {
     return NULL;
   }
 
-  cmd = parseredir(cmd);
+  *parseredir(&rl) = NULL;
 
-  return cmd;
+  return redirect(cmd, rl);
 }
 
 struct cmd *parsesub(void) {
@@ -189,15 +226,19 @@ struct cmd *parsesub(void) {
 }
 
 static struct cmd *parsecmplist(void) {
+  struct cmdlist *cl, **clp = &cl;
   struct cmd *c;
 
   linebreak();
 
-  c = parsecond();
-
-  while (separator() && !cmplistdone()) {
-    c = bincmd(CLIST, c, parsecond());
-  }
+  do {
+    c = parsecond();
+    if (yytoken == TBGND)
+      c = bincmd(CBGND, c, NULL);
+    clp = addcmd(clp, c);
+  } while (separator() && !cmplistdone());
+  *clp = NULL;
+  c = sequence(cl);
 
   if (yytoken == TSEMI || yytoken == TBGND)
     nexttoken();
@@ -314,8 +355,7 @@ static struct cmd *parsefor(void) {
 
   while (nexttoken() == TWORD) {
     *app = stalloc(sizeof(**app));
-    (*app)->text = yytext;
-    (*app)->subst = subst;
+    setword(*app);
     app = &(*app)->next;
   }
   *app = NULL;
@@ -338,8 +378,7 @@ static struct arg *patternlist(void) {
     if (yytoken != TWORD)
       expecting(TWORD);
 
-    p->text = yytext;
-    p->subst = subst;
+    setword(p);
 
     if (nexttoken() == TPIPE) {
       p->next = stalloc(sizeof(*pat));
@@ -402,8 +441,7 @@ static struct cmd *parsecase(void) {
     unexpected();
 
   struct arg *expr = stalloc(sizeof(*expr));
-  expr->text = yytext;
-  expr->subst = subst;
+  setword(expr);
   expr->next = NULL;
 
   nexttoken();
@@ -421,35 +459,49 @@ static struct cmd *parsecase(void) {
 static struct cmd *parsesimple(void) {
   struct cmd *cmd;
   struct cexec *ecmd;
-  struct arg **app;
+  struct arg *ap, **app;
+  struct redirlist *rl, **rlp;
+  char **av;
 
   cmd = execcmd();
   ecmd = (struct cexec *)cmd;
   app = &ecmd->args;
 
-  cmd = parseredir(cmd);
+  rlp = parseredir(&rl);
 
   while (yytoken == TWORD) {
     *app = stalloc(sizeof(**app));
-    (*app)->text = yytext;
-    (*app)->subst = subst;
+    setword(*app);
     app = &(*app)->next;
     ecmd->argc++;
     nexttoken();
-    cmd = parseredir(cmd);
+    rlp = parseredir(rlp);
   }
   *app = NULL;
+  *rlp = NULL;
 
-  if (yytoken == TLPAR && (struct cmd *)ecmd == cmd && ecmd->args->next == NULL)
+  if (yytoken == TLPAR && !rl && ecmd->argc == 1)
     return parsefunc(ecmd->args->text);
 
+  /* a command can be nothing but redirections */
   if (!ecmd->argc)
-    return NULL;
-  return cmd;
+    return rl ? redirect(cmd, rl) : NULL;
+
+  /* nothing to expand, the words can be passed as they are */
+  for (ap = ecmd->args; ap && (ap->flags & ARG_LITERAL); ap = ap->next)
+    ;
+  if (!ap && !isassignment(ecmd->args->text)) {
+    ecmd->argv = av = stalloc(sizeof(*av) * (ecmd->argc + 1));
+    for (ap = ecmd->args; ap; ap = ap->next)
+      *av++ = ap->text;
+    *av = NULL;
+  }
+  return redirect(cmd, rl);
 }
 
 static struct cmd *parsefunc(char *name) {
   struct cmd *body;
+  struct redirlist *rl;
 
   if (yytoken != TLPAR)
     expecting(TLPAR);
@@ -463,6 +515,13 @@ static struct cmd *parsefunc(char *name) {
   nexttoken();
   linebreak();
 
+  /* in a sourced file the body is parsed when the function is first called */
+  if (parsefile->lazy && !vflag && checkwd() == TLBRC && (body = lazybody())) {
+    nexttoken();
+    *parseredir(&rl) = NULL;
+    return funccmd(name, redirect(body, rl));
+  }
+
   body = parsecmpcmd();
   if (!body)
     body = parsesimple();
@@ -472,10 +531,35 @@ static struct cmd *parsefunc(char *name) {
   return funccmd(name, body);
 }
 
-static struct cmd *parseredir(struct cmd *cmd) {
+/* parse a function body skipped by lazybody(), on the first call */
+struct cmd *parselazy(struct clazy *cz) {
+  struct cmd *c;
+
+  setinputstring(cz->text, INPUT_PUSH_FILE);
+  plineno = cz->lineno;
+  /* so syntax errors name the file the body was read from */
+  pfname = xstrdup(cz->fname);
+
+  nexttoken();
+  if (checkwd() != TLBRC)
+    expecting(TLBRC);
+  c = parsesub();
+  if (nexttoken() != TNL || nexttoken() != TEOF)
+    unexpected();
+
+  popfile();
+  return c;
+}
+
+/*
+ * Collect the redirections at the current position onto *rlp and return
+ * the new tail of the list.
+ */
+static struct redirlist **parseredir(struct redirlist **rlp) {
   int fd;
   int op;
-  struct credir *cr;
+  int striptabs, quoted;
+  struct redirlist *rl;
 
   for (;;) {
     switch (yytoken) {
@@ -488,6 +572,11 @@ static struct cmd *parseredir(struct cmd *cmd) {
     case TDGRT:
       fd = 1;
       break;
+    case TDLSS:
+    case TDLSD:
+    case TTLSS:
+      fd = 0;
+      break;
     case TWORD:
       op = skipspaces();
       pungetc();
@@ -511,11 +600,19 @@ static struct cmd *parseredir(struct cmd *cmd) {
     case TDGRT:
       op = '+';
       break;
+    case TDLSS:
+    case TDLSD:
+      op = 'h';
+      break;
+    case TTLSS:
+      op = 's';
+      break;
     default:
       unexpected();
       goto out;
     }
 
+    striptabs = yytoken == TDLSD;
     nexttoken();
 
     if (yytoken != TWORD) {
@@ -525,27 +622,69 @@ static struct cmd *parseredir(struct cmd *cmd) {
 
     /* expand yytext for full filename */
     struct arg *filename = stalloc(sizeof(*filename));
-    filename->text = yytext;
-    filename->subst = subst;
-    filename->next = NULL;
-
-    /* stack redirection in FIFO order
-     * this can be optimized but I dont care :)
-     * realistically a command has very few redirections
-     */
-
-    if (cmd->type == CREDIR) {
-      cr = (struct credir *)cmd;
-      while (cr->cmd->type == CREDIR)
-        cr = (struct credir *)cr->cmd;
-      cr->cmd = redircmd(cr->cmd, filename, op, fd);
+    if (op == 'h') {
+      /* the body is filled in at the end of the line */
+      filename->text  = "";
+      filename->subst = NULL;
+      filename->flags = ARG_LITERAL;
+      quoted          = unquote(yytext);
+      pushheredoc(filename, yytext, striptabs, quoted);
     } else {
-      cmd = redircmd(cmd, filename, op, fd);
+      setword(filename);
     }
+    filename->next = NULL;
+
+    rl          = stalloc(sizeof(*rl));
+    rl->r.fname = filename;
+    rl->r.mode  = op;
+    rl->r.fd    = fd;
+    *rlp        = rl;
+    rlp         = &rl->next;
     nexttoken();
   }
 out:
-  return cmd;
+  return rlp;
+}
+
+static struct cmdlist **addcmd(struct cmdlist **clp, struct cmd *c) {
+  struct cmdlist *cl;
+
+  cl      = stalloc(sizeof(*cl));
+  cl->cmd = c;
+  *clp    = cl;
+  return &cl->next;
+}
+
+/* pack the collected commands into one node, unless there is just one */
+static struct cmd *sequence(struct cmdlist *cl) {
+  struct cseq *cs;
+  struct cmdlist *p;
+  int n = 0;
+
+  if (!cl->next)
+    return cl->cmd;
+  for (p = cl; p; p = p->next)
+    n++;
+  cs = (struct cseq *)seqcmd(n);
+  for (n = 0; cl; cl = cl->next)
+    cs->cmd[n++] = cl->cmd;
+  return (struct cmd *)cs;
+}
+
+/* pack the collected redirections into a single node around cmd */
+static struct cmd *redirect(struct cmd *cmd, struct redirlist *rl) {
+  struct credir *cr;
+  struct redirlist *p;
+  int n = 0;
+
+  if (!rl)
+    return cmd;
+  for (p = rl; p; p = p->next)
+    n++;
+  cr = (struct credir *)redircmd(cmd, n);
+  for (n = 0; rl; rl = rl->next)
+    cr->redir[n++] = rl->r;
+  return (struct cmd *)cr;
 }
 
 static int separator(void) {
@@ -605,6 +744,45 @@ static int cmplistdone(void) {
   }
 }
 
+/* fill in a word from the current token */
+static void setword(struct arg *ap) {
+  const char *p;
+
+  for (p = yytext; charclass(*p, CC_WORD); p++)
+    ;
+  ap->text  = yytext;
+  ap->subst = subst;
+  ap->flags = *p || ispattern(yytext) ? 0 : ARG_LITERAL;
+}
+
+/*
+ * Remove quotes from a here-document delimiter in place. Returns whether
+ * there were any, in which case the body is not expanded.
+ */
+int unquote(char *s) {
+  char *p = s;
+  int str = 0, quoted = 0;
+
+  for (; *s; s++) {
+    if (*s == '\\' && str != '\'' && s[1]) {
+      quoted = 1;
+      *p++   = *++s;
+    } else if (*s == '\'' || *s == '"') {
+      quoted = 1;
+      if (str == *s)
+        str = 0;
+      else if (!str)
+        str = *s;
+      else
+        *p++ = *s;
+    } else {
+      *p++ = *s;
+    }
+  }
+  *p = '\0';
+  return quoted;
+}
+
 static int ionumber(const char *word) {
   return (isdigit(word[0]) && !word[1]) ? (word[0] - '0') : (-1);
 }
@@ -623,9 +801,66 @@ static void syntaxerr(const char *fmt, ...) {
   if (yytoken != TNL)
     consumeline(1);
 
+  /* name the file being parsed if it was pushed, as . and FPATH files are */
   va_list ap;
   va_start(ap, fmt);
-  vpreraiseerr("syntax error: ", fmt, ap);
+  vpreraiseerr(parsefile->prev && pfname ? pfname : arg0, "syntax error: ", fmt,
+               ap);
   /* unreachable */
   va_end(ap);
 }
+
+/*
+ * sh --parse-stats script...
+ *
+ * Parses each script without running it and reports the tokens read, the
+ * nodes built, the bytes taken from the stack allocator and the wall time.
+ * A script that cannot be read or parsed is reported and skipped.
+ */
+int parse_stats(char **argv) {
+  struct jmploc *volatile savehandler;
+  struct parsefile *volatile savepf;
+  volatile int status = 0;
+  struct jmploc here;
+  struct stackmark mark;
+  struct timespec t0, t1;
+  long tokens, nodes;
+  size_t bytes;
+
+  if (!*argv)
+    raiseerr("--parse-stats requires an argument");
+  savehandler = handler;
+  savepf      = parsefile;
+  for (; *argv; argv++) {
+    tokens = ntokens;
+    nodes  = ncmdnodes;
+    bytes  = stallocated;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    pushstackmark(&mark);
+    if (setjmp(here.loc)) {
+      unwindfiles(savepf);
+      popstackmark(&mark);
+      yytoken = TNL;
+      status  = exitstatus;
+      FORCEINTON;
+      continue;
+    }
+    handler = &here;
+
+    setinputfile(*argv, INPUT_PUSH_FILE);
+    while (parseline())
+      popstackmark(&mark);
+    popstackmark(&mark);
+    popfile();
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("%s: %ld tokens, %ld nodes, %zu bytes, %.3f ms\n", *argv,
+           ntokens - tokens, ncmdnodes - nodes, stallocated - bytes,
+           (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    /* keep the report in order with the errors on stderr */
+    fflush(stdout);
+  }
+  handler = savehandler;
+  return status;
+}
@@ -2,7 +2,12 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include "cmd.h"
+
 struct cmd *parseline(void);
 struct cmd *parsesub(void);
+struct cmd *parselazy(struct clazy *);
+int unquote(char *);
+int parse_stats(char **);
 
 #endif
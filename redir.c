@@ -1,6 +1,10 @@
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "cmd.h"
@@ -12,19 +16,72 @@
 
 struct redirtab {
   struct redirtab *next;
-  int fd;
-  int save;
+  int n;
+  struct {
+    int fd;
+    int save; /* copy of the old descriptor, -1 if it was closed */
+  } saved[];
 };
 
 int preverrfd = 2;
 struct redirtab *redirlist;
 
-int pushredirect(struct credir *cr) {
-  struct redirtab *rtab;
+static int xwrite(int fd, const char *p, size_t n) {
+  ssize_t nw;
 
-  int mode, ofd;
+  while (n > 0) {
+    if ((nw = write(fd, p, n)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += nw;
+    n -= nw;
+  }
+  return 0;
+}
+
+/*
+ * Open a here-document or here-string for reading. A body that fits in a
+ * pipe is written to one up front; a larger one goes in a sealed memfd.
+ * Either way there is no temporary file and no writer process.
+ */
+static int openhere(const char *body, size_t len) {
+  int fd, pip[2];
+
+  if (len > PIPE_BUF) {
+    if ((fd = memfd_create("heredoc", MFD_ALLOW_SEALING)) < 0)
+      return -1;
+    if (xwrite(fd, body, len) < 0 ||
+        fcntl(fd, F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0 ||
+        lseek(fd, 0, SEEK_SET) < 0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
 
-  switch (cr->mode) {
+  if (pipe(pip) < 0)
+    return -1;
+  if (xwrite(pip[1], body, len) < 0) {
+    close(pip[0]);
+    close(pip[1]);
+    return -1;
+  }
+  close(pip[1]);
+  return pip[0];
+}
+
+/* expand and open the target of a redirection */
+static int openredir(struct redir *r) {
+  struct arg *ap;
+  const char *fname;
+  char *body;
+  size_t len;
+  int mode, fd;
+
+  switch (r->mode) {
   case '<':
     mode = O_RDONLY;
     break;
@@ -34,52 +91,96 @@ int pushredirect(struct credir *cr) {
   case '+':
     mode = O_CREAT | O_APPEND | O_WRONLY;
     break;
+  case 'h':
+    ap   = expandarg(r->fname, NULL, EXP_NOSPLIT | EXP_HEREDOC);
+    body = ap ? ap->text : "";
+    len  = strlen(body);
+    goto here;
+  case 's':
+    /* the word is fed with a newline, like a one-line here-document */
+    fname = exparg(r->fname);
+    len   = strlen(fname);
+    body  = stalloc(len + 1);
+    memcpy(body, fname, len);
+    body[len++] = '\n';
+  here:
+    if ((fd = openhere(body, len)) < 0)
+      perrorf("here-document:");
+    return fd;
   default:
     die("unknown redirection");
     break;
   }
 
-  const char *fname = exparg(cr->fname);
-
-  INTOFF;
-  if ((ofd = open(fname, mode, 0666)) < 0) {
+  fname = exparg(r->fname);
+  if ((fd = open(fname, mode, 0666)) < 0)
     perrorf("%s:", fname);
-    goto bad;
-  }
-
-  rtab       = stalloc(sizeof(*rtab));
-  rtab->fd   = cr->fd;
-  rtab->save = fcntl(cr->fd, F_GETFD) != (-1) ? savefd(cr->fd) : (-1);
+  return fd;
+}
 
-  if (ofd != cr->fd) {
-    if (dup2(ofd, cr->fd) < 0) {
-      perrorf("pushredirect: %d:", cr->fd);
-      goto del;
-    }
-    close(ofd);
+/*
+ * Apply all the redirections of a command in one pass. The old descriptors
+ * are saved in one frame for popredirect(), and a descriptor redirected
+ * more than once is saved only the first time. With REDIR_NOSAVE nothing is
+ * saved, for a child that is going to exit anyway.
+ */
+int pushredirect(struct credir *cr, int flags) {
+  struct redirtab *rtab = NULL;
+  int i, j, fd, ofd;
+
+  if (!(flags & REDIR_NOSAVE)) {
+    INTOFF;
+    rtab       = stalloc(sizeof(*rtab) + cr->nredir * sizeof(*rtab->saved));
+    rtab->n    = 0;
+    rtab->next = redirlist;
+    redirlist  = rtab;
+    INTON;
   }
 
-  rtab->next = redirlist;
-  redirlist  = rtab;
+  for (i = 0; i < cr->nredir; i++) {
+    fd = cr->redir[i].fd;
+    if ((ofd = openredir(&cr->redir[i])) < 0)
+      goto bad;
+
+    INTOFF;
+    if (rtab) {
+      for (j = 0; j < rtab->n && rtab->saved[j].fd != fd; j++)
+        ;
+      if (j == rtab->n) {
+        /* if the open took fd itself, fd was closed before */
+        rtab->saved[j].fd   = fd;
+        rtab->saved[j].save = ofd != fd && fcntl(fd, F_GETFD) != (-1)
+                                  ? savefd(fd)
+                                  : (-1);
+        rtab->n++;
+        if (fd == 2)
+          preverrfd = rtab->saved[j].save;
+      }
+    }
 
-  if (cr->fd == 2) {
-    preverrfd = rtab->save;
+    if (ofd != fd) {
+      if (dup2(ofd, fd) < 0) {
+        perrorf("pushredirect: %d:", fd);
+        close(ofd);
+        INTON;
+        goto bad;
+      }
+      close(ofd);
+    }
+    INTON;
   }
+  return 0;
 
-  INTON;
-  return cr->fd;
-
-del:
-  if (rtab->save > 0)
-    close(rtab->save);
-  stfree(rtab);
 bad:
-  INTON;
+  if (rtab)
+    popredirect();
   return -1;
 }
 
+/* undo the last pushredirect() */
 void popredirect(void) {
   struct redirtab *rtab;
+  int i, fd, save;
 
   if (!redirlist)
     return;
@@ -88,21 +189,25 @@ void popredirect(void) {
   rtab      = redirlist;
   redirlist = redirlist->next;
 
-  if (rtab->save >= 0) {
-    if (dup2(rtab->save, rtab->fd) < 0)
-      perrorf("popredir: %d %d:", rtab->save, rtab->fd);
-    close(rtab->save);
-  } else {
-    close(rtab->fd);
-  }
-  if (rtab->fd == 2) {
-    preverrfd = 2;
+  for (i = rtab->n; --i >= 0;) {
+    fd   = rtab->saved[i].fd;
+    save = rtab->saved[i].save;
+    if (save >= 0) {
+      if (dup2(save, fd) < 0)
+        perrorf("popredir: %d %d:", save, fd);
+      close(save);
+    } else {
+      close(fd);
+    }
+    if (fd == 2)
+      preverrfd = 2;
   }
   INTON;
 }
 
-void unwindredir(void) {
-  while (redirlist)
+/* pop redirections down to rtab, NULL for all of them */
+void unwindredir(struct redirtab *rtab) {
+  while (redirlist && redirlist != rtab)
     popredirect();
 }
 
@@ -4,11 +4,16 @@
 
 #include "cmd.h"
 
+#define REDIR_NOSAVE (1 << 0) /* the caller is a child about to exit */
+
+struct redirtab;
+
 extern int preverrfd;
+extern struct redirtab *redirlist;
 
-int pushredirect(struct credir *);
+int pushredirect(struct credir *, int flags);
 void popredirect(void);
-void unwindredir(void);
+void unwindredir(struct redirtab *);
 int savefd(int);
 
 #endif
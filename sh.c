@@ -16,6 +16,7 @@
 #include "parser.h"
 #include "redir.h"
 #include "sh.h"
+#include "source.h"
 #include "trap.h"
 #include "var.h"
 
@@ -31,10 +32,11 @@ int main(int argc, char **argv) {
 
   if ((exception = setjmp(jmploc.loc))) {
     /* reset the shell */
-    unwindredir();
+    unwindredir(NULL);
     unwindloops();
     unwindrets();
     unwindlocalvars(NULL);
+    unwindpins(0);
     closescript();
     yytoken = TNL;
     popstackmark(&mark);
@@ -45,6 +47,8 @@ int main(int argc, char **argv) {
       goto exit;
     case 1:
       goto state1;
+    case 2:
+      goto state2;
     default:
       goto state4;
       break;
@@ -55,17 +59,20 @@ int main(int argc, char **argv) {
     initvar();
     signal_init();
   }
-  parsefile->isatty = isatty(parsefile->fd);
-  handler           = &jmploc;
+  initstdin();
+  handler = &jmploc;
   FORCEINTON;
   procargs(argv);
   state = 1;
 state1:
 
+  state = 2;
   if (minusc) {
     evalstring(minusc);
   }
+state2:
 
+  state = 4;
   if (sflag || !minusc)
   state4:
     repl();
@@ -77,8 +84,10 @@ int repl() {
   struct cmd *cmd;
   struct stackmark mark;
 
+  /* with -n commands are only parsed */
   for (pushstackmark(&mark); (cmd = parseline()); popstackmark(&mark))
-    eval(cmd);
+    if (!nflag)
+      eval(cmd);
 
   return exitstatus;
 }
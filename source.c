@@ -0,0 +1,218 @@
+/** \file source.c
+ *
+ * Caches of parsed top-level commands, for sourced files and for eval
+ * strings, so running the same code again doesn't go through the lexer and
+ * parser.
+ */
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cmd.h"
+#include "error.h"
+#include "mem.h"
+#include "source.h"
+
+#define SRCTABSIZE 17
+static struct srcfile *srctab[SRCTABSIZE];
+
+/*
+ * Entries being run are pinned so their commands aren't freed under them.
+ * The pins are kept on a stack, and whatever unwinds the shell on an error,
+ * break or return drops those made since it was set up, as it does with
+ * input files and redirections.
+ */
+static int **pins;
+static int maxpins;
+int npins;
+
+void pin(int *busy) {
+  INTOFF;
+  if (npins == maxpins) {
+    maxpins = maxpins ? maxpins * 2 : 16;
+    pins    = xrealloc(pins, maxpins * sizeof(*pins));
+  }
+  (*busy)++;
+  pins[npins++] = busy;
+  INTON;
+}
+
+void unwindpins(int stop) {
+  while (npins > stop)
+    (*pins[--npins])--;
+}
+
+/*
+ * Find the cache entry for the file at `fname`, adding one if needed.
+ * An entry whose file has changed since it was recorded is emptied.
+ * Returns NULL if the file can't be stat'ed, or if it has changed while
+ * the old commands are still being run.
+ */
+struct srcfile *lookupsrc(const char *fname) {
+  struct stat st;
+  struct srcfile *sp, **spp;
+
+  if (stat(fname, &st) < 0)
+    return NULL;
+
+  spp = &srctab[(st.st_ino ^ st.st_dev) % SRCTABSIZE];
+  for (sp = *spp; sp; sp = sp->next)
+    if (sp->ino == st.st_ino && sp->dev == st.st_dev)
+      break;
+
+  if (!sp) {
+    INTOFF;
+    sp         = xmalloc(sizeof(*sp));
+    sp->next   = *spp;
+    sp->dev    = st.st_dev;
+    sp->ino    = st.st_ino;
+    sp->busy   = 0;
+    sp->flags  = 0;
+    sp->ncmds  = 0;
+    sp->nalloc = 0;
+    sp->cmds   = NULL;
+    *spp       = sp;
+    INTON;
+  } else if (sp->size != st.st_size ||
+             sp->mtime.tv_sec != st.st_mtim.tv_sec ||
+             sp->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+    if (sp->busy)
+      return NULL;
+    clearsrc(sp);
+    sp->flags = 0;
+  }
+  sp->size  = st.st_size;
+  sp->mtime = st.st_mtim;
+  return sp;
+}
+
+/* append a copy of a freshly parsed command */
+void recordsrc(struct srcfile *sp, struct cmd *c) {
+  INTOFF;
+  if (sp->ncmds == sp->nalloc) {
+    sp->nalloc = sp->nalloc ? sp->nalloc * 2 : 16;
+    sp->cmds   = xrealloc(sp->cmds, sp->nalloc * sizeof(*sp->cmds));
+  }
+  sp->cmds[sp->ncmds++] = copycmd(c);
+  INTON;
+}
+
+/* drop the recorded commands */
+void clearsrc(struct srcfile *sp) {
+  INTOFF;
+  while (sp->ncmds > 0)
+    freecmd(sp->cmds[--sp->ncmds]);
+  sp->flags &= ~SRC_CACHED;
+  INTON;
+}
+
+/*
+ * eval strings
+ *
+ * A bounded LRU list keyed by the string. Entries in use are pinned, and
+ * can't be evicted.
+ */
+
+#define EVALCACHESIZE 64
+#define EVALMAXLEN    4096
+
+static struct evalent *evalhead; /* most recently used first */
+static int nevals;
+
+static unsigned int evalhash(const char *s) {
+  unsigned int h = 0;
+
+  while (*s)
+    h = h * 31 + (unsigned char)*s++;
+  return h;
+}
+
+static void freeeval(struct evalent *ep) {
+  cleareval(ep);
+  if (ep->prev)
+    ep->prev->next = ep->next;
+  else
+    evalhead = ep->next;
+  if (ep->next)
+    ep->next->prev = ep->prev;
+  free(ep->cmds);
+  free(ep);
+  nevals--;
+}
+
+/*
+ * Find the entry for `s`, adding one if needed, and pin it. Returns NULL
+ * if `s` is too long or every entry is in use.
+ */
+struct evalent *lookupeval(const char *s) {
+  struct evalent *ep, *last = NULL;
+  unsigned int hash;
+  size_t len;
+
+  if ((len = strlen(s)) > EVALMAXLEN)
+    return NULL;
+
+  hash = evalhash(s);
+  for (ep = evalhead; ep; last = ep, ep = ep->next)
+    if (ep->hash == hash && strcmp(ep->str, s) == 0)
+      break;
+
+  INTOFF;
+  if (!ep) {
+    if (nevals >= EVALCACHESIZE) {
+      for (ep = last; ep && ep->busy; ep = ep->prev)
+        ;
+      if (!ep) {
+        INTON;
+        return NULL;
+      }
+      freeeval(ep);
+    }
+    ep         = xmalloc(sizeof(*ep) + len + 1);
+    ep->prev   = NULL;
+    ep->next   = NULL;
+    ep->hash   = hash;
+    ep->busy   = 0;
+    ep->flags  = 0;
+    ep->ncmds  = 0;
+    ep->nalloc = 0;
+    ep->cmds   = NULL;
+    memcpy(ep->str, s, len + 1);
+    nevals++;
+  } else if (ep != evalhead) {
+    ep->prev->next = ep->next;
+    if (ep->next)
+      ep->next->prev = ep->prev;
+    ep->prev = NULL;
+  }
+  if (ep != evalhead) {
+    ep->next = evalhead;
+    if (evalhead)
+      evalhead->prev = ep;
+    evalhead = ep;
+  }
+
+  pin(&ep->busy);
+  INTON;
+  return ep;
+}
+
+/* append a copy of a freshly parsed command */
+void recordeval(struct evalent *ep, struct cmd *c) {
+  INTOFF;
+  if (ep->ncmds == ep->nalloc) {
+    ep->nalloc = ep->nalloc ? ep->nalloc * 2 : 4;
+    ep->cmds   = xrealloc(ep->cmds, ep->nalloc * sizeof(*ep->cmds));
+  }
+  ep->cmds[ep->ncmds++] = copycmd(c);
+  INTON;
+}
+
+/* drop the recorded commands */
+void cleareval(struct evalent *ep) {
+  INTOFF;
+  while (ep->ncmds > 0)
+    freecmd(ep->cmds[--ep->ncmds]);
+  ep->flags &= ~SRC_CACHED;
+  INTON;
+}
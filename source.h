@@ -0,0 +1,54 @@
+/** \file source.h
+ */
+
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <sys/stat.h>
+
+#include "cmd.h"
+
+#define SRC_LOADED (1 << 0) /* has been sourced at least once */
+#define SRC_CACHED (1 << 1) /* cmds holds the whole file */
+
+/* a sourced file, identified by (dev, ino, mtime, size) */
+struct srcfile {
+  struct srcfile *next;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  int busy; /* runs of it under way, see pin() */
+  int flags;
+  int ncmds;
+  int nalloc;
+  struct cmd **cmds;
+};
+
+struct srcfile *lookupsrc(const char *);
+void recordsrc(struct srcfile *, struct cmd *);
+void clearsrc(struct srcfile *);
+
+extern int npins;
+
+void pin(int *);
+void unwindpins(int);
+
+/* an eval string, flags as above */
+struct evalent {
+  struct evalent *prev;
+  struct evalent *next;
+  unsigned int hash;
+  int busy; /* pins held on it */
+  int flags;
+  int ncmds;
+  int nalloc;
+  struct cmd **cmds;
+  char str[];
+};
+
+struct evalent *lookupeval(const char *);
+void recordeval(struct evalent *, struct cmd *);
+void cleareval(struct evalent *);
+
+#endif
@@ -7,10 +7,48 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "error.h"
+#include "mem.h"
 #include "str.h"
 
+#define CC_ISDELIM(c)                                                          \
+  ((c) == ' ' || (c) == '(' || (c) == ')' || (c) == '<' || (c) == '>' ||       \
+   (c) == '&' || (c) == '\n' || (c) == '\t' || (c) == '\r' || (c) == '\v' ||    \
+   (c) == ';' || (c) == '|')
+#define CC_ISALPHA(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z'))
+#define CC_ISDIGIT(c) ((c) >= '0' && (c) <= '9')
+#define CC_ISPRINT(c) ((c) >= ' ' && (c) <= '~')
+
+/* clang-format off */
+#define CC(c)                                                                  \
+  ((CC_ISALPHA(c) || (c) == '_' ? CC_NAME | CC_INNAME : 0) |                   \
+   (CC_ISDIGIT(c) ? CC_DIGIT | CC_INNAME | CC_SPECIAL : 0) |                   \
+   ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\v' ? CC_BLANK : 0) |   \
+   (CC_ISDELIM(c) ? CC_DELIM : 0) |                                            \
+   (CC_ISPRINT(c) && !CC_ISDELIM(c) && (c) != '$' && (c) != '\'' &&            \
+    (c) != '"' && (c) != '\\' ? CC_WORD : 0) |                                 \
+   (CC_ISPRINT(c) || ((c) >= '\t' && (c) <= '\r') ? CC_TEXT : 0) |             \
+   ((c) == '$' || (c) == '?' || (c) == '@' || (c) == '*' || (c) == '#'         \
+    ? CC_SPECIAL : 0))
+#define CC4(c)   CC(c), CC((c) + 1), CC((c) + 2), CC((c) + 3)
+#define CC16(c)  CC4(c), CC4((c) + 4), CC4((c) + 8), CC4((c) + 12)
+#define CC64(c)  CC16(c), CC16((c) + 16), CC16((c) + 32), CC16((c) + 48)
+/* clang-format on */
+
+/*
+ * Character classes indexed by unsigned char, shared by the lexer and the
+ * expander so neither has to go through the locale-aware ctype functions
+ * or strchr() a delimiter list per character.
+ */
+const unsigned char chartab[256] = {
+    CC64(0),
+    CC64(64),
+    CC64(128),
+    CC64(192),
+};
+
 void badnum(const char *s) { raiseerr("illegal number: %s", s); }
 
 char *endofname(const char *name) {
@@ -69,33 +107,207 @@ int number(const char *s) {
   return n;
 }
 
-int glob_match(const char *str, const char *pat) {
-  const char *star  = 0;
-  const char *match = 0;
-
-  while (*str) {
-    if (*pat == '?' || *pat == *str) {
-      str++;
-      pat++;
-    } else if (*pat == '*') {
-      star = pat;
-
-      /* collapse consecutive '*' */
-      while (*pat == '*')
-        pat++;
-
-      match = str;
-    } else if (star) {
-      pat = star + 1;
-      str = ++match;
-    } else {
-      return 0;
+static const struct {
+  const char *name;
+  int (*is)(int);
+} patclasses[] = {
+    {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+    {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+    {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+    {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+};
+
+#define NCLASSES       ((int)(sizeof(patclasses) / sizeof(*patclasses)))
+#define SETBIT(set, c) ((set)[(c) >> 5] |= 1u << ((c) & 31))
+
+/* Reads a bracket expression, p just past the `[`. Returns the end of it, or
+ * NULL if it is not closed and the `[` is an ordinary character. */
+static const char *patset(const char *p, uint32_t *set) {
+  const char *q, *e;
+  int c, lo, neg, i;
+
+  memset(set, 0, 8 * sizeof(*set));
+  if ((neg = *p == '!' || *p == '^'))
+    p++;
+
+  for (q = p; (c = (unsigned char)*q++) != ']' || q - 1 == p;) {
+    if (!c)
+      return NULL;
+    if (c == '[' && *q == ':' && (e = strstr(q + 1, ":]"))) {
+      for (i = 0; i < NCLASSES; i++)
+        if (strncmp(q + 1, patclasses[i].name, e - q - 1) == 0 &&
+            !patclasses[i].name[e - q - 1])
+          break;
+      if (i < NCLASSES) {
+        for (c = 1; c < 256; c++)
+          if (patclasses[i].is(c))
+            SETBIT(set, c);
+        q = e + 2;
+        continue;
+      }
+    }
+    if (c == '\\' && *q)
+      c = (unsigned char)*q++;
+    lo = c;
+    if (q[0] == '-' && q[1] && q[1] != ']') {
+      q++;
+      if ((c = (unsigned char)*q++) == '\\' && *q)
+        c = (unsigned char)*q++;
+    }
+    for (; lo <= c; lo++)
+      SETBIT(set, lo);
+  }
+
+  if (neg)
+    for (i = 0; i < 8; i++)
+      set[i] = ~set[i];
+  return q;
+}
+
+/*
+ * Compiles a glob pattern onto the stack: runs of plain characters become
+ * one literal, `[...]` a 256-bit set. A backslash quotes the next character.
+ */
+struct pattern *patcompile(const char *pat) {
+  struct pattern *pt;
+  struct patop *op, *lit = NULL;
+  uint32_t *set;
+  const char *p, *q;
+  char *l;
+  size_t n, nsets = 0;
+  int c;
+
+  for (p = pat; *p; p++)
+    nsets += *p == '[';
+  n  = p - pat;
+  pt = stalloc(sizeof(*pt) + (n + 1) * sizeof(*op) +
+               nsets * 8 * sizeof(*set) + n);
+  op  = pt->op;
+  set = (uint32_t *)(op + n + 1);
+  l   = (char *)(set + nsets * 8);
+
+  pt->minlen = 0;
+  pt->fixed  = 1;
+  for (p = pat; (c = *p++);) {
+    switch (c) {
+    case '*':
+      if (op == pt->op || op[-1].type != PSTAR)
+        (op++)->type = PSTAR;
+      pt->fixed = 0;
+      lit       = NULL;
+      continue;
+    case '?':
+      (op++)->type = PANY;
+      pt->minlen++;
+      lit = NULL;
+      continue;
+    case '[':
+      if (!(q = patset(p, set)))
+        break;
+      op->type  = PSET;
+      (op++)->set = set;
+      set += 8;
+      p = q;
+      pt->minlen++;
+      lit = NULL;
+      continue;
+    case '\\':
+      if (*p)
+        c = *p++;
+      break;
+    }
+    if (!lit) {
+      lit       = op++;
+      lit->type = PLIT;
+      lit->len  = 0;
+      lit->lit  = l;
     }
+    *l++ = c;
+    lit->len++;
+    pt->minlen++;
+  }
+  pt->nops = op - pt->op;
+  return pt;
+}
+
+/*
+ * Whether the n bytes at s match the whole pattern. Only the last `*` is
+ * ever backtracked into: everything between two stars has a fixed width,
+ * so matching it at the earliest place is never wrong.
+ */
+int patmatch(const struct pattern *pt, const char *s, size_t n) {
+  const struct patop *op = pt->op, *end = op + pt->nops, *star = NULL;
+  const char *e = s + n, *resume = NULL;
+  unsigned char c;
+
+  if (n < (size_t)pt->minlen || (pt->fixed && n != (size_t)pt->minlen))
+    return 0;
+
+  while (op < end || s < e) {
+    if (op < end) {
+      switch (op->type) {
+      case PSTAR:
+        star   = ++op;
+        resume = s;
+        continue;
+      case PLIT:
+        if (e - s >= op->len && memcmp(s, op->lit, op->len) == 0) {
+          s += op->len;
+          op++;
+          continue;
+        }
+        break;
+      case PANY:
+        if (s < e) {
+          s++;
+          op++;
+          continue;
+        }
+        break;
+      case PSET:
+        if (s < e && (c = *s, op->set[c >> 5] >> (c & 31) & 1)) {
+          s++;
+          op++;
+          continue;
+        }
+        break;
+      }
+    }
+    if (!star || resume == e)
+      return 0;
+    op = star;
+    s  = ++resume;
   }
+  return 1;
+}
+
+int glob_match(const char *str, const char *pat) {
+  struct pattern *pt = patcompile(pat);
+  int match          = patmatch(pt, str, strlen(str));
 
-  /* allow trailing '*' to match empty */
-  while (*pat == '*')
-    pat++;
+  stfree(pt);
+  return match;
+}
 
-  return *pat == '\0';
+/*
+ * Whether s has anything patcompile() does not take literally: a `*`, a `?`
+ * or a `[` closed later on. A backslash quotes the next character.
+ */
+int ispattern(const char *s) {
+  for (; *s; s++) {
+    switch (*s) {
+    case '*':
+    case '?':
+      return 1;
+    case '[':
+      if (s[1] && strchr(s + 2, ']'))
+        return 1;
+      break;
+    case '\\':
+      if (s[1])
+        s++;
+      break;
+    }
+  }
+  return 0;
 }
@@ -6,19 +6,61 @@
 #define STR_H
 
 #include <ctype.h>
+#include <stddef.h>
 #include <stdint.h>
 
-#define is_name(c)    ((c) == '_' || isalpha((unsigned char)(c)))
-#define is_in_name(c) ((c) == '_' || isalnum((unsigned char)(c)))
+/* character classes, see chartab in str.c */
+#define CC_NAME    (1 << 0) /* may start a name: [A-Za-z_] */
+#define CC_INNAME  (1 << 1) /* may continue a name: [A-Za-z0-9_] */
+#define CC_DIGIT   (1 << 2) /* [0-9] */
+#define CC_BLANK   (1 << 3) /* skipped between tokens */
+#define CC_DELIM   (1 << 4) /* terminates an unquoted word */
+#define CC_WORD    (1 << 5) /* copied verbatim into an unquoted word */
+#define CC_TEXT    (1 << 6) /* anything the lexer doesn't discard as garbage */
+#define CC_SPECIAL (1 << 7) /* single character parameter: $?@*# and digits */
+
+extern const unsigned char chartab[256];
+
+#define charclass(c, cls) (chartab[(unsigned char)(c)] & (cls))
+
+#define is_name(c)    charclass((c), CC_NAME)
+#define is_in_name(c) charclass((c), CC_INNAME)
+#define is_digit(c)   charclass((c), CC_DIGIT)
 
 int isassignment(const char *word);
 char *endofname(const char *s);
 static inline int goodname(const char *p) { return !*endofname(p); }
 
 void badnum(const char *) __attribute__((noreturn));
+int atomax(const char *, int, intmax_t *);
 int atomax10(const char *, intmax_t *);
 int number(const char *);
 
+/* one element of a compiled pattern */
+struct patop {
+  int type; /* PLIT, PANY, PSET or PSTAR */
+  int len;  /* bytes of a PLIT */
+  union {
+    const char *lit;
+    const uint32_t *set; /* 256-bit class of a PSET */
+  };
+};
+
+#define PLIT  0
+#define PANY  1
+#define PSET  2
+#define PSTAR 3
+
+struct pattern {
+  int nops;
+  int minlen; /* bytes every match takes */
+  int fixed;  /* no `*`, so minlen is the only length that matches */
+  struct patop op[];
+};
+
+struct pattern *patcompile(const char *);
+int patmatch(const struct pattern *, const char *, size_t);
 int glob_match(const char *str, const char *pat);
+int ispattern(const char *);
 
 #endif
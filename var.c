@@ -2,6 +2,8 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <limits.h>
 #include <stdio.h>
@@ -10,6 +12,7 @@
 #include <unistd.h>
 
 #include "error.h"
+#include "expand.h"
 #include "input.h"
 #include "mem.h"
 #include "output.h"
@@ -48,7 +51,7 @@ struct var varinit[] = {
     {0, VSTSTAT | VTXSTAT,           "PS2=> ",    0},
     {0, VSTSTAT | VTXSTAT,           "PS4=+ ",    0},
     {0, VSTSTAT | VTXSTAT,           linenovar,   0},
-    {0, VSTSTAT | VTXSTAT,           "IFS= \t\n", 0},
+    {0, VSTSTAT | VTXSTAT,           "IFS= \t\n", changeifs},
     {0, VSTSTAT | VTXSTAT | VRDONLY, ppid,        0},
 };
 
@@ -184,7 +187,7 @@ struct var *setvareq(char *s, int flags) {
       goto out;
 
     if (vp->func && (flags & VNOFUNC) == 0)
-      vp->func(strchrnul(s, '=') + 1);
+      vp->func(flags & VUNSET ? NULL : varnull(s));
 
     if ((vp->flags & (VTXSTAT | VSTACK)) == 0)
       free(vp->text);
@@ -254,6 +257,7 @@ int read_builtin(int argc, char **argv) {
     return 2;
   }
 
+  syncstdin();
   STARTSTACKSTR(line);
   while ((n = read(0, &c, 1)) > 0 && c != '\n')
     STPUTC(c, line);
@@ -389,7 +393,7 @@ static void poplocalvars(void) {
       vp->flags = lvp->flags;
       vp->text = lvp->text;
       if (vp->func && !(vp->flags & VNOFUNC))
-        (*vp->func)(varnull(vp->text));
+        (*vp->func)(vp->flags & VUNSET ? NULL : varnull(vp->text));
     }
     free(lvp);
   }
@@ -18,10 +18,11 @@ struct var {
   struct var *next;
   int flags;
   char *text;
-  void (*func)(const char *); /* callback function */
+  void (*func)(const char *); /* callback function, NULL when unset */
 };
 
 extern struct var varinit[];
+extern char nullstr[];
 
 void initvar(void);
 struct var *setvar(const char *, const char *, int);
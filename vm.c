@@ -0,0 +1,571 @@
+/** \file vm.c
+ *
+ * Bytecode for the evaluator.
+ *
+ * compilecode() flattens a command tree into an array of instructions in
+ * which `&&`, `||`, if, while, for and case are jumps, and runcode() runs
+ * it with a direct-threaded loop. Simple commands go to evalcmd(), and the
+ * nodes the compiler leaves alone (pipes, subshells, redirections,
+ * background jobs and function definitions) to the tree-walker in eval().
+ *
+ * Loops keep their frames on the VM's own stack and link them into the
+ * usual `loops` chain, so break and continue reach them the same way they
+ * reach the loops of eval().
+ */
+
+#include <setjmp.h>
+#include <string.h>
+
+#include "cmd.h"
+#include "error.h"
+#include "eval.h"
+#include "expand.h"
+#include "input.h"
+#include "mem.h"
+#include "redir.h"
+#include "source.h"
+#include "str.h"
+#include "var.h"
+#include "vm.h"
+
+enum {
+  I_END,
+  I_EXEC,      /* cexec */
+  I_EXECLIT,   /* cexec: one with a literal argv */
+  I_EVAL,      /* cmd */
+  I_JMP,       /* target */
+  I_JZ,        /* target: jump if exitstatus is 0 */
+  I_JNZ,       /* target: jump if it isn't */
+  I_NOT,       /* */
+  I_TRUE,      /* */
+  I_TEST,      /* target: end a condition, jump if it failed */
+  I_TESTZ,     /* target: end a condition, jump if it succeeded */
+  I_EXECTEST,  /* cexec target: I_EXEC, I_TEST */
+  I_EXECTESTZ, /* cexec target: I_EXEC, I_TESTZ */
+  I_LOOP,      /* break continue: push a loop frame */
+  I_FOR,       /* cfor break continue: push a loop frame over the list */
+  I_NEXT,      /* target: set the for variable, jump if the list is done */
+  I_ITER,      /* end an iteration */
+  I_POPLOOP,   /* */
+  I_CASE,      /* ccase slot: expand the word into the slot */
+  I_MATCH,     /* cases slot target: jump if a pattern matches */
+  I_ENDCASE,   /* slot */
+  I_MAX
+};
+
+/* length of each instruction, operands included */
+static const unsigned char oplen[I_MAX] = {
+    [I_END] = 1,       [I_EXEC] = 2,        [I_EXECLIT] = 2, [I_EVAL] = 2,
+    [I_JMP] = 2,       [I_JZ] = 2,          [I_JNZ] = 2,     [I_NOT] = 1,
+    [I_TRUE] = 1,      [I_TEST] = 2,        [I_TESTZ] = 2,   [I_EXECTEST] = 3,
+    [I_EXECTESTZ] = 3, [I_LOOP] = 3,        [I_FOR] = 4,     [I_NEXT] = 2,
+    [I_ITER] = 1,      [I_POPLOOP] = 1,     [I_CASE] = 3,    [I_MATCH] = 4,
+    [I_ENDCASE] = 2,
+};
+
+/*
+ * compiler
+ */
+
+static union insn *cbuf;
+static int clen;
+static int ccap;
+
+static int depth, maxdepth;   /* of loops */
+static int cdepth, maxcdepth; /* of cases */
+
+/* left spines of lists waiting for their right hand sides */
+static struct cbinary **spine;
+static int nspine;
+static int spinecap;
+
+static void compilenode(struct cmd *);
+
+static int emit(intptr_t n) {
+  if (clen == ccap) {
+    ccap = ccap ? ccap * 2 : 64;
+    cbuf = xrealloc(cbuf, ccap * sizeof(*cbuf));
+  }
+  cbuf[clen].n = n;
+  return clen++;
+}
+
+static void emitp(void *p) {
+  int at = emit(0); /* may move cbuf */
+  cbuf[at].p = p;
+}
+
+/* point the jump operand at `at` to the next instruction */
+#define PATCH(at) (cbuf[at].n = clen)
+
+/*
+ * Compile a condition ending with `op`, and return the position of its
+ * jump operand. A lone simple command fuses with the test.
+ */
+static int compilecond(struct cmd *c, int op) {
+  if (c->type == CEXEC) {
+    emit(op == I_TEST ? I_EXECTEST : I_EXECTESTZ);
+    emitp(c);
+  } else {
+    compilenode(c);
+    emit(op);
+  }
+  return emit(0);
+}
+
+/*
+ * Lists are left-deep, so walk the left spine instead of recursing down
+ * it, then emit the right hand sides bottom up.
+ */
+static void compilelist(struct cmd *c) {
+  int at, base = nspine;
+  struct cbinary *cb;
+
+  for (; c->type == CLIST || c->type == CAND || c->type == COR;
+       c = ((struct cbinary *)c)->left) {
+    if (nspine == spinecap) {
+      spinecap = spinecap ? spinecap * 2 : 32;
+      spine    = xrealloc(spine, spinecap * sizeof(*spine));
+    }
+    spine[nspine++] = (struct cbinary *)c;
+  }
+  compilenode(c);
+
+  while (nspine > base) {
+    cb = spine[--nspine];
+    if (!cb->right)
+      continue;
+    if (cb->type == CLIST) {
+      compilenode(cb->right);
+    } else {
+      emit(cb->type == CAND ? I_JNZ : I_JZ);
+      at = emit(0);
+      compilenode(cb->right);
+      PATCH(at);
+    }
+  }
+}
+
+static void compileloop(struct cloop *cl) {
+  int brk, cont, at;
+
+  emit(I_LOOP);
+  brk  = emit(0);
+  cont = emit(0);
+  if (++depth > maxdepth)
+    maxdepth = depth;
+
+  PATCH(cont);
+  at = compilecond(cl->cond, cl->type == CWHILE ? I_TEST : I_TESTZ);
+  compilenode(cl->body);
+  emit(I_ITER);
+  emit(I_JMP);
+  emit(cbuf[cont].n);
+
+  PATCH(at);
+  PATCH(brk);
+  emit(I_POPLOOP);
+  depth--;
+}
+
+static void compilefor(struct cfor *cf) {
+  int brk, cont, at;
+
+  emit(I_FOR);
+  emitp(cf);
+  brk  = emit(0);
+  cont = emit(0);
+  if (++depth > maxdepth)
+    maxdepth = depth;
+
+  PATCH(cont);
+  emit(I_NEXT);
+  at = emit(0);
+  compilenode(cf->body);
+  emit(I_ITER);
+  emit(I_JMP);
+  emit(cbuf[cont].n);
+
+  PATCH(at);
+  PATCH(brk);
+  emit(I_POPLOOP);
+  depth--;
+}
+
+/*
+ * I_CASE, one I_MATCH per item, then the bodies in order so that `;&`
+ * falls through into the next one. Jumps to the end are chained through
+ * their operands until the end is known.
+ */
+static void compilecase(struct ccase *cc) {
+  int i, next, match, ends = -1;
+  int slot = cdepth++;
+  struct cases *cs;
+
+  if (cdepth > maxcdepth)
+    maxcdepth = cdepth;
+
+  emit(I_CASE);
+  emitp(cc);
+  emit(slot);
+
+  match = clen;
+  for (cs = cc->list; cs; cs = cs->next) {
+    emit(I_MATCH);
+    emitp(cs);
+    emit(slot);
+    emit(0);
+  }
+  emit(I_TRUE);
+  emit(I_JMP);
+  ends = emit(ends);
+
+  for (i = 0, cs = cc->list; cs; cs = cs->next, i++) {
+    PATCH(match + i * oplen[I_MATCH] + 3);
+    if (cs->cmd)
+      compilenode(cs->cmd);
+    if (!cs->fallthrough) {
+      emit(I_JMP);
+      ends = emit(ends);
+    }
+  }
+
+  for (; ends >= 0; ends = next) {
+    next = cbuf[ends].n;
+    PATCH(ends);
+  }
+  emit(I_ENDCASE);
+  emit(slot);
+  cdepth--;
+}
+
+static void compilenode(struct cmd *c) {
+  int at, end, i;
+  struct cif *ci;
+
+  switch (c->type) {
+  case CEXEC:
+    emit(((struct cexec *)c)->argv ? I_EXECLIT : I_EXEC);
+    emitp(c);
+    break;
+
+  case CBANG:
+    compilenode(((struct cunary *)c)->cmd);
+    emit(I_NOT);
+    break;
+
+  case CBRC:
+    compilenode(((struct cunary *)c)->cmd);
+    break;
+
+  case CSEQ:
+    for (i = 0; i < ((struct cseq *)c)->n; i++)
+      compilenode(((struct cseq *)c)->cmd[i]);
+    break;
+
+  case CLIST:
+  case CAND:
+  case COR:
+    compilelist(c);
+    break;
+
+  case CIF:
+    ci = (struct cif *)c;
+    at = compilecond(ci->cond, I_TEST);
+    compilenode(ci->ifpart);
+    if (ci->elsepart) {
+      emit(I_JMP);
+      end = emit(0);
+      PATCH(at);
+      compilenode(ci->elsepart);
+      PATCH(end);
+    } else {
+      PATCH(at);
+    }
+    break;
+
+  case CWHILE:
+  case CUNTIL:
+    compileloop((struct cloop *)c);
+    break;
+
+  case CFOR:
+    compilefor((struct cfor *)c);
+    break;
+
+  case CCASE:
+    compilecase((struct ccase *)c);
+    break;
+
+  default:
+    emit(I_EVAL);
+    emitp(c);
+    break;
+  }
+}
+
+/*
+ * Compile `c`. The code is put on the stack unless `persistent` is set,
+ * in which case it is malloc'ed and freed with freecode().
+ */
+struct code *compilecode(struct cmd *c, int persistent) {
+  struct code *code;
+  size_t size;
+
+  clen   = 0;
+  nspine = 0;
+  depth = maxdepth = 0;
+  cdepth = maxcdepth = 0;
+
+  compilenode(c);
+  emit(I_END);
+
+  size = sizeof(*code) + clen * sizeof(*cbuf);
+  if (persistent) {
+    INTOFF;
+    code = xmalloc(size);
+    INTON;
+  } else {
+    code = stalloc(size);
+  }
+  code->threaded = 0;
+  code->nframes  = maxdepth;
+  code->nslots   = maxcdepth;
+  code->len      = clen;
+  memcpy(code->insn, cbuf, clen * sizeof(*cbuf));
+  return code;
+}
+
+void freecode(struct code *code) { free(code); }
+
+/*
+ * virtual machine
+ */
+
+struct frame {
+  struct looploc here;
+  struct parsefile *pf;   /* input to go back to */
+  struct redirtab *redir; /* and redirections */
+  int pins;               /* and cache pins */
+  struct jmploc *handler; /* break skips evalbltin() putting these back */
+  char *cmdname;
+  struct stackmark fmark; /* before the for list */
+  struct stackmark mark;  /* before the body */
+  intptr_t brk;
+  intptr_t cont;
+  char *var;
+  struct arg *iter;
+};
+
+struct slot {
+  const char *word;
+  struct stackmark mark;
+};
+
+#define NEXT goto *pc->op
+#define JUMP(t)                                                                \
+  do {                                                                         \
+    pc = base + (t);                                                           \
+    NEXT;                                                                      \
+  } while (0)
+
+int runcode(struct code *code) {
+  static const void *const ops[I_MAX] = {
+      [I_END] = &&end,             [I_EXEC] = &&exec,
+      [I_EXECLIT] = &&execlit,     [I_EVAL] = &&eval,
+      [I_JMP] = &&jmp,             [I_JZ] = &&jz,
+      [I_JNZ] = &&jnz,             [I_NOT] = &&not_,
+      [I_TRUE] = &&true_,          [I_TEST] = &&test,
+      [I_TESTZ] = &&testz,         [I_EXECTEST] = &&exectest,
+      [I_EXECTESTZ] = &&exectestz, [I_LOOP] = &&loop,
+      [I_FOR] = &&for_,            [I_NEXT] = &&next,
+      [I_ITER] = &&iter,           [I_POPLOOP] = &&poploop,
+      [I_CASE] = &&case_,          [I_MATCH] = &&match,
+      [I_ENDCASE] = &&endcase,
+  };
+  union insn *const base = code->insn;
+  union insn *pc;
+  struct frame frames[code->nframes + 1];
+  struct slot slots[code->nslots + 1];
+  volatile int fp = -1;
+  struct frame *f;
+  struct cfor *cf;
+  struct arg *ap;
+  int op, st;
+
+  if (!code->threaded) {
+    for (pc = base; pc < base + code->len; pc += oplen[op]) {
+      op     = pc->n;
+      pc->op = ops[op];
+    }
+    code->threaded = 1;
+  }
+
+  pc = base;
+  NEXT;
+
+exec:
+  exitstatus = evalcmd(pc[1].p, NULL);
+  pc += 2;
+  NEXT;
+
+execlit:
+  exitstatus = evalargv(pc[1].p, NULL);
+  pc += 2;
+  NEXT;
+
+eval:
+  exitstatus = eval(pc[1].p);
+  pc += 2;
+  NEXT;
+
+jmp:
+  JUMP(pc[1].n);
+
+jz:
+  if (exitstatus == 0)
+    JUMP(pc[1].n);
+  pc += 2;
+  NEXT;
+
+jnz:
+  if (exitstatus != 0)
+    JUMP(pc[1].n);
+  pc += 2;
+  NEXT;
+
+not_:
+  exitstatus = !exitstatus;
+  pc++;
+  NEXT;
+
+true_:
+  exitstatus = 0;
+  pc++;
+  NEXT;
+
+test:
+  st         = exitstatus;
+  exitstatus = 0;
+  if (st)
+    JUMP(pc[1].n);
+  pc += 2;
+  NEXT;
+
+testz:
+  st         = exitstatus;
+  exitstatus = 0;
+  if (!st)
+    JUMP(pc[1].n);
+  pc += 2;
+  NEXT;
+
+exectest:
+  st         = evalcmd(pc[1].p, NULL);
+  exitstatus = 0;
+  if (st)
+    JUMP(pc[2].n);
+  pc += 3;
+  NEXT;
+
+exectestz:
+  st         = evalcmd(pc[1].p, NULL);
+  exitstatus = 0;
+  if (!st)
+    JUMP(pc[2].n);
+  pc += 3;
+  NEXT;
+
+loop:
+  f       = &frames[fp + 1];
+  f->brk  = pc[1].n;
+  f->cont = pc[2].n;
+  f->var  = NULL;
+  f->iter = NULL;
+  pushstackmark(&f->fmark);
+  pc += 3;
+  goto enter;
+
+for_:
+  cf      = pc[1].p;
+  f       = &frames[fp + 1];
+  f->brk  = pc[2].n;
+  f->cont = pc[3].n;
+  f->var  = cf->var;
+  pushstackmark(&f->fmark);
+  if (!(f->iter = expandargs(cf->list, EXP_FULL)))
+    exitstatus = 0;
+  pc += 4;
+
+enter:
+  fp++;
+  f->pf      = parsefile;
+  f->redir   = redirlist;
+  f->pins    = npins;
+  f->handler = handler;
+  f->cmdname = commandname;
+  pushstackmark(&f->mark);
+  f->here.next = loops;
+  loops        = &f->here;
+  if ((st = setjmp(f->here.loc))) {
+    /* poploop() unlinked the target and everything inside it */
+    for (f = &frames[fp]; f->here.next != loops; f--)
+      ;
+    fp = f - frames;
+    unwindfiles(f->pf);
+    unwindredir(f->redir);
+    unwindpins(f->pins);
+    handler     = f->handler;
+    commandname = f->cmdname;
+    popstackmark(&f->mark);
+    if (st == SKIPBREAK)
+      JUMP(f->brk);
+    loops = &f->here;
+    JUMP(f->cont);
+  }
+  NEXT;
+
+next:
+  f = &frames[fp];
+  if (!(ap = f->iter))
+    JUMP(pc[1].n);
+  f->iter = ap->next;
+  setvar(f->var, ap->text, 0);
+  pc += 2;
+  NEXT;
+
+iter:
+  popstackmark(&frames[fp].mark);
+  pc++;
+  NEXT;
+
+poploop:
+  f     = &frames[fp--];
+  loops = f->here.next;
+  popstackmark(&f->fmark);
+  pc++;
+  NEXT;
+
+case_:
+  pushstackmark(&slots[pc[2].n].mark);
+  slots[pc[2].n].word = exparg(((struct ccase *)pc[1].p)->expr);
+  pc += 3;
+  NEXT;
+
+match:
+  for (ap = ((struct cases *)pc[1].p)->patterns; ap; ap = ap->next)
+    if (glob_match(slots[pc[2].n].word, exppattern(ap))) {
+      exitstatus = 0;
+      JUMP(pc[3].n);
+    }
+  pc += 4;
+  NEXT;
+
+endcase:
+  popstackmark(&slots[pc[1].n].mark);
+  pc += 2;
+  NEXT;
+
+end:
+  return exitstatus;
+}
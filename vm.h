@@ -0,0 +1,29 @@
+/** \file vm.h
+ */
+
+#ifndef VM_H
+#define VM_H
+
+#include <stdint.h>
+
+#include "cmd.h"
+
+union insn {
+  const void *op; /* handler, once the code is threaded */
+  intptr_t n;     /* opcode before that, jump target or slot */
+  void *p;        /* node operand */
+};
+
+struct code {
+  int threaded;
+  int nframes; /* deepest loop nesting */
+  int nslots;  /* deepest case nesting */
+  int len;
+  union insn insn[];
+};
+
+struct code *compilecode(struct cmd *, int persistent);
+int runcode(struct code *);
+void freecode(struct code *);
+
+#endif